@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  // MAP_POPULATE, madvise, posix_fadvise, copy_file_range, sendfile
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,6 +6,23 @@
 #include <sys/stat.h>
 #include <time.h>  // Required for random number generation
 #include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 
 #define MAX_PATH_LENGTH 256
@@ -12,21 +30,167 @@
 #define MAX_CLUSTERS 4096
 #define FAT_FREE (-1)
 #define FAT_END (-2)
+#define NO_PARENT (-2)  // resolve_parent: the directory that should hold a path does not exist
+
+// Flush policies for the memory-mapped image
+#define MSYNC_SYNC 0   // msync(MS_SYNC) after every cluster write
+#define MSYNC_ASYNC 1  // msync(MS_ASYNC) - schedule writeback, do not wait
+#define MSYNC_NONE 2   // leave writeback to the kernel
+
+#define MAX_EXTENT_CLUSTERS 256  // Largest single transfer (1 MB); also the copy window size
+
+// Cluster I/O engines for chain transfers
+#define IO_ENGINE_SYNC 0     // one blocking pread/pwrite after another
+#define IO_ENGINE_URING 1    // batches submitted through io_uring
+#define IO_ENGINE_THREADS 2  // portable fallback: a pool of threads doing pread/pwrite
+#define IO_CHUNK_CLUSTERS 32 // async engines split extents into 128 KB requests to fill the queue
+#define MAX_QUEUE_DEPTH 256
+
+#define STREAM_BATCH_CLUSTERS 64  // incp from a pipe reserves this many clusters at a time
+
+#define COPY_MAX_THREADS 64  // workers of a directory cp (by default one per online CPU)
+
+#define DEFAULT_CACHE_MB 16  // Size of the write-back cluster cache at startup
+#define CAT_CACHED_CLUSTERS 16  // cat reads files up to this size (64 KB) through the cache
+
+#define READAHEAD_MIN_CLUSTERS 8      // window after a random (non-sequential) chain read
+#define READAHEAD_MAX_CLUSTERS 1024   // default cap for the adaptive window (4 MB)
+
+// On-disk layout: superblock (cluster 0), FAT region, then the data clusters.
+// The directory table lives in an ordinary FAT chain inside the data region.
+#define SUPERBLOCK_MAGIC "PSFAT\0\0\0"
+#define SUPERBLOCK_VERSION 2
+#define MOUNT_NO_FILESYSTEM (-1)  // no superblock: a new or foreign image
+#define MOUNT_CORRUPTED (-2)      // superblock present but unusable
 
 
 int *fat = NULL;
+int *cluster_refs = NULL;  // References to each cluster: file starts plus FAT links pointing at it
+uint64_t *free_bitmap = NULL;     // One bit per cluster, set while the cluster is free
+size_t free_cluster_count = 0;    // Kept in step with the bitmap, so free space is O(1)
 static size_t cluster_count = 0;
 static size_t max_clusters = MAX_CLUSTERS;
 
+// Where a file's chain lies: runs[i] holds logical clusters runs[i].logical onwards in
+// count physically consecutive clusters from start, sorted by logical
+typedef struct {
+    size_t logical;
+    int start;
+    size_t count;
+} MappedRun;
+
+typedef struct {
+    size_t cluster_count;
+    size_t shared_from;  // first logical cluster also reached by another file (cluster_count if none)
+    size_t run_count;
+    size_t run_capacity;
+    MappedRun runs[];
+} ExtentMap;
+
 // Pseudo FAT structure (simplified for the task)
 typedef struct {
-    char filename[MAX_PATH_LENGTH];
+    const char *name;  // interned last path component; the full path comes from the tree
     size_t size;
     size_t start_cluster;
     size_t end_cluster;
     int is_directory;
+    // Directory tree as entry handles; -1 stands for the root (or no entry)
+    int parent;
+    int first_child;
+    int last_child;
+    int prev_sibling;
+    int next_sibling;
+    ExtentMap *extents;  // built on first random access, dropped whenever the chain changes
 } FileEntry;
 
+// A run of physically consecutive clusters taken from a FAT chain
+typedef struct {
+    int start;
+    size_t count;
+} Extent;
+
+// One queued transfer for the I/O engine
+typedef struct {
+    int is_write;
+    off_t offset;
+    char *buffer;
+    size_t size;
+    struct iovec iov;
+} IoRequest;
+
+// One cluster held by the buffer cache; slots form a doubly linked LRU list
+typedef struct {
+    int cluster;  // -1 while the slot is unused
+    int dirty;
+    int prev;     // towards the most recently used slot
+    int next;     // towards the least recently used slot
+} CacheSlot;
+
+// Read-ahead state of the chain currently being streamed
+typedef struct {
+    int expected;      // cluster a sequential reader will ask for next
+    int ahead;         // first chain cluster not yet prefetched
+    size_t ahead_count; // clusters prefetched beyond the reader's position
+    size_t window;     // current prefetch distance, doubles while access stays sequential
+    size_t max_window; // 0 disables read-ahead
+} ReadAhead;
+
+// One slot of the path index; the hash is kept so that growing never rehashes a path
+typedef struct {
+    uint32_t hash;
+    int index;  // entry handle, -1 while the slot is empty
+} PathSlot;
+
+// One slot of the path resolution cache: an absolute path and the entry it led to
+typedef struct {
+    uint32_t hash;
+    uint32_t generation;  // dentry_generation when filled; any other value means stale
+    int index;
+    size_t length;
+    char path[MAX_PATH_LENGTH];
+} DentrySlot;
+
+// One slot of the name table, NULL name while empty
+typedef struct {
+    uint32_t hash;
+    uint32_t refs;  // entries using the name; an unused name stays until the next collect
+    const char *name;
+} NameSlot;
+
+// First cluster of the image. Offsets are in bytes from the start of the image file.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_size;
+    uint64_t cluster_count;      // data clusters (entries in the FAT)
+    uint64_t fat_offset;
+    uint64_t data_offset;
+    int32_t directory_start;     // first cluster of the directory table chain, FAT_FREE when none
+    uint32_t directory_clusters; // length of that chain
+    uint64_t directory_bytes;    // bytes of directory records in it
+    uint32_t entry_count;
+    uint32_t clean;              // 1 after a clean unmount, 0 while mounted
+    uint32_t checksum;           // over everything above
+} Superblock;
+
+// Directory table record, followed by name_length bytes of the name (no terminator)
+typedef struct {
+    uint64_t size;
+    int32_t start_cluster;
+    int32_t end_cluster;
+    int32_t parent;  // position of the parent's record, -1 for the root
+    uint16_t name_length;
+    uint8_t is_directory;
+    uint8_t reserved;
+} DirectoryRecord;
+
+// FAT scan kernels; one set per instruction set, picked at startup
+typedef struct {
+    const char *name;
+    uint64_t (*free_bits)(const int *entries, size_t count);  // bit i set when entries[i] is FAT_FREE, count <= 64
+    size_t (*find_invalid)(const int *entries, size_t count, size_t from, int limit);
+} FatKernels;
+
 typedef struct {
     const char *command_name;
     void (*command_func)(const char *);
@@ -53,7 +217,96 @@ void fs_info();
 int count_free_clusters();
 void write_cluster_data(int cluster_index, const char *data, size_t size);
 void read_cluster_data(int cluster_index, char *buffer, size_t size);
+int next_extent(int *cluster, size_t max_count, Extent *extent);
+void read_chain_data(int *cluster, char *buffer, size_t size);
+void write_chain_data(int *cluster, const char *buffer, size_t size);
 void free_clusters(FileEntry *file);
+void clone_file(const char *args);
+int claim_cluster();
+int take_free_run(size_t wanted, int goal, Extent *run);
+void release_run(int start, size_t count);
+size_t count_extents(int start_cluster);
+void defrag(const char *args);
+void select_fat_kernels();
+size_t fat_count_free(const int *entries, size_t count);
+void fatbench(const char *arg);
+double elapsed_ms(struct timespec start);
+off_t cluster_offset(int cluster);
+int offset_cluster(off_t offset);
+void count_cluster_references(int *refs);
+void rebuild_free_space();
+int write_metadata(int clean);
+int mount_filesystem();
+FileEntry *entry_at(int handle);
+void entry_store_reserve(size_t count);
+void entry_store_reset();
+int entry_is_free(size_t index);
+const char *intern_name(const char *name, size_t length);
+void name_table_reset();
+void name_table_collect();
+void name_release(const char *name);
+void dentry_invalidate();
+void entry_store_compact();
+void entry_store_maybe_compact();
+int insert_entry(const FileEntry *entry);
+void remove_entry(size_t index);
+void rename_entry(size_t index, int parent, const char *name);
+void path_index_rebuild();
+uint32_t hash_name(const char *name, size_t length);
+int resolve_path(const char *path, size_t length);
+int find_directory(const char *path, int *dir);
+int resolve_parent(const char *path, char *name);
+void entry_path(int index, char *path);
+size_t subtree_path_length(int dir);
+int subtree_path_fits(int index, int parent, const char *name);
+void tree_link(int index, int parent);
+void tree_unlink(int index);
+void tree_rebuild();
+int defrag_file(FileEntry *file);
+void mark_cluster_used(int cluster);
+void mark_cluster_free(int cluster);
+int extend_chain(FileEntry *file, size_t clusters);
+size_t record_size(const char *name);
+size_t directory_shortfall(size_t extra);
+int table_fits(size_t clusters, size_t record_bytes);
+void incp_stream(FILE *src, const char *full_path, size_t limit);
+size_t read_limited(FILE *src, char *buffer, size_t size, size_t *left);
+int unshare_cluster(FileEntry *file, size_t position);
+int unshare_tail(FileEntry *file);
+ExtentMap *extent_map_get(FileEntry *file);
+void extent_map_drop(FileEntry *file);
+int extent_map_lookup(const ExtentMap *map, size_t logical);
+void extent_map_append(FileEntry *file, int start, size_t count);
+void extent_map_trim(FileEntry *file, size_t clusters);
+void release_chain(int cluster);
+void read_cmd(const char *args);
+void write_cmd(const char *args);
+void append_cmd(const char *args);
+void truncate_cmd(const char *args);
+int open_disk();
+void close_disk();
+int map_disk();
+void unmap_disk();
+void mmap_mode(const char *arg);
+void disk_read(off_t offset, char *buffer, size_t size);
+void disk_write(off_t offset, const char *data, size_t size);
+void submit_io_batch(IoRequest *requests, int count);
+void shutdown_io_engine();
+int io_pool_start(int threads);
+void io_mode(const char *arg);
+int cache_configure(size_t size_mb);
+void cache_flush();
+void cache_invalidate();
+void cache_cmd(const char *arg);
+void drop_caches(const char *arg);
+void sync_cmd(const char *arg);
+void read_ahead(int start, int next, size_t clusters);
+void readahead_cmd(const char *arg);
+void copy_chain_data(int src_cluster, int dest_cluster, size_t size);
+void copy_chain_extents(int src_cluster, int dest_cluster, size_t size);
+void copy_tree(int src_index, int dest_parent, const char *dest_name, int threads);
+void cache_forget(int cluster, size_t count);
+void send_chain_data(int cluster, size_t size, int out_fd);
 
 void remove_directory_wrapper(const char *arg) {
     remove_directory(arg); // Вызов оригинальной функции с адаптированным аргументом
@@ -61,6 +314,7 @@ void remove_directory_wrapper(const char *arg) {
 
 Command command_table[] = {
     {"cp", (void (*)(const char *))cp},
+    {"clone", clone_file},
     {"mv", (void (*)(const char *))mv},
     {"rm", rm},
     {"mkdir", create_directory},
@@ -76,15 +330,98 @@ Command command_table[] = {
     {"load", load},
     {"bug", bug},     // Добавляем команду bug
     {"check", check},  // Добавляем команду check
-    {"fs", fs_info}  // Добавляем команду check
+    {"fs", fs_info},  // Добавляем команду check
+    {"mmap", mmap_mode},
+    {"io", io_mode},
+    {"cache", cache_cmd},
+    {"drop_caches", drop_caches},
+    {"sync", sync_cmd},
+    {"readahead", readahead_cmd},
+    {"defrag", defrag},
+    {"fatbench", fatbench},
+    {"read", read_cmd},
+    {"write", write_cmd},
+    {"append", append_cmd},
+    {"truncate", truncate_cmd}
 };
 
-// Simulated pseudo-FAT file system metadata
-#define MAX_FILES 100
-FileEntry filesystem[MAX_FILES];
-size_t file_count = 0;
+// Simulated pseudo-FAT file system metadata. Entries live in fixed-size slabs that are
+// allocated on demand and never move, so an entry pointer stays valid while the store grows.
+#define ENTRY_SLAB_SHIFT 10
+#define ENTRY_SLAB_SIZE (1 << ENTRY_SLAB_SHIFT)
+FileEntry **entry_slabs = NULL;
+size_t entry_slab_count = 0;     // slabs allocated
+size_t entry_slab_capacity = 0;  // room in entry_slabs
+size_t file_count = 0;           // slots in use, including removed ones awaiting compaction
+// Removed entries stay in place as tombstones (empty name) chained through next_sibling, so
+// a delete is O(1); insert reuses them and entry_store_compact() squeezes them out later
+#define ENTRY_COMPACT_MIN 1024
+int free_entry_head = -1;
+size_t free_entry_count = 0;
+
+// Every distinct name component is stored once, in chunks that never move, so an entry holds
+// a pointer instead of a fixed buffer. Names left unused by removes and renames are dropped
+// once their bytes outweigh the used ones, or when the store is compacted.
+#define NAME_CHUNK_SIZE 65536
+char **name_chunks = NULL;
+size_t name_chunk_count = 0;
+size_t name_chunk_capacity = 0;
+size_t name_chunk_used = 0;  // bytes taken in the last chunk
+size_t name_live_bytes = 0;  // names with refs > 0, terminators included
+size_t name_dead_bytes = 0;  // names with refs == 0
+// Resolved paths, direct mapped. Creating entries cannot change what a cached path leads to;
+// removing, renaming or renumbering them can, so those bump the generation instead.
+#define DENTRY_CACHE_SIZE 1024
+DentrySlot dentry_cache[DENTRY_CACHE_SIZE];
+uint32_t dentry_generation = 1;
+NameSlot *name_table = NULL;
+size_t name_table_capacity = 0;  // always a power of two
+size_t name_table_count = 0;
+
+// Path -> entry handle: open addressing with linear probing, at most half full
+PathSlot *path_index = NULL;
+size_t path_index_capacity = 0;  // always a power of two
+
+// Free-extent index: the same free runs sorted by offset (for merging neighbours on free)
+// and by size, then offset (for best-fit allocation)
+Extent *free_by_offset = NULL;
+Extent *free_by_size = NULL;
+size_t free_extent_count = 0;
+size_t free_extent_capacity = 0;
 char current_path[MAX_PATH_LENGTH] = "/";
+int current_dir = -1;       // Entry of current_path, -1 at the root
+int root_first_child = -1;  // Child list of the root, which has no entry of its own
+int root_last_child = -1;
 char disk_filename[MAX_PATH_LENGTH];  // Здесь сохраним имя файла, переданного при запуске
+int disk_fd = -1;                     // Mounted image, opened once and reused for every cluster transfer
+off_t fat_offset = 0;                 // Where the FAT region starts in the image
+off_t data_offset = 0;                // Where cluster 0 starts in the image
+FileEntry directory_table = {"", 0, FAT_FREE, FAT_FREE, 1, -1, -1, -1, -1, -1};  // Chain holding the directory records
+size_t directory_clusters = 0;
+size_t directory_entries = 0;         // Records in the table on disk
+size_t directory_record_bytes = 0;    // What the live entries' records take; allocations leave room for it
+char *disk_map = NULL;                // Mapping of the whole image when the mmap backend is on
+size_t disk_map_size = 0;
+int use_mmap = 0;
+int msync_policy = MSYNC_ASYNC;
+int io_engine = IO_ENGINE_SYNC;
+int io_queue_depth = 16;
+
+// Write-back LRU cluster cache in front of the image
+CacheSlot *cache_slots = NULL;
+char *cache_data = NULL;       // cache_capacity clusters, slot i owns cache_data[i * CLUSTER_SIZE]
+int *cache_index = NULL;       // cluster -> slot, -1 when not cached (max_clusters entries)
+size_t cache_index_size = 0;
+int cache_capacity = 0;
+int cache_used = 0;
+int cache_mru = -1;
+int cache_lru = -1;
+size_t cache_mb = DEFAULT_CACHE_MB;
+size_t cache_hits = 0;
+size_t cache_misses = 0;
+size_t cache_writebacks = 0;
+
+ReadAhead readahead_state = {FAT_END, FAT_END, 0, READAHEAD_MIN_CLUSTERS, READAHEAD_MAX_CLUSTERS};
 
 void fs_info() {
     // 1) Get the size of the filesystem image file using stat()
@@ -99,17 +436,11 @@ void fs_info() {
     printf("Filesystem total size: %zu bytes (%zu MB)\n", (size_t)st.st_size,(size_t)st.st_size / 1024/1024);
 
     cluster_count = (size_t)st.st_size / CLUSTER_SIZE;
+    printf("Metadata clusters: %zu (superblock and FAT)\n", (size_t)(data_offset / CLUSTER_SIZE));
 
-    // 2) Count free and used clusters
-    int free_clusters = 0;
-    int used_clusters = 0;
-    for (int i = 0; i < cluster_count; i++) {
-        if (fat[i] == FAT_FREE) {
-            free_clusters++;
-        } else {
-            used_clusters++;
-        }
-    }
+    // 2) Free and used clusters come from the maintained counter
+    int free_clusters = (int)free_cluster_count;
+    int used_clusters = (int)(max_clusters - free_cluster_count);
     printf("Total clusters: %llu\n", cluster_count);
     printf("Used clusters: %d\n", used_clusters);
     printf("Free clusters: %d\n", free_clusters);
@@ -127,9 +458,15 @@ void initialize_fat() {
         free(fat);
     }
 
+    free(cluster_refs);
+    free(free_bitmap);
+
     // Allocate memory for FAT
+    size_t bitmap_words = (max_clusters + 63) / 64;
     fat = (int*)malloc(max_clusters * sizeof(int));
-    if (!fat) {
+    cluster_refs = (int*)calloc(max_clusters, sizeof(int));
+    free_bitmap = (uint64_t*)malloc(bitmap_words * sizeof(uint64_t));
+    if (!fat || !cluster_refs || !free_bitmap) {
         printf("ERROR: Cannot allocate FAT\n");
         exit(EXIT_FAILURE);
     }
@@ -138,438 +475,1094 @@ void initialize_fat() {
     for (int i = 0; i < max_clusters; i++) {
         fat[i] = FAT_FREE;
     }
+    memset(free_bitmap, 0xff, bitmap_words * sizeof(uint64_t));
+    if (max_clusters % 64) {
+        free_bitmap[bitmap_words - 1] = (UINT64_C(1) << (max_clusters % 64)) - 1; // no bits past the end
+    }
+    free_cluster_count = max_clusters;
+
+    // The whole volume starts out as one free extent
+    free(free_by_offset);
+    free(free_by_size);
+    free_extent_capacity = 64;
+    free_by_offset = malloc(free_extent_capacity * sizeof(Extent));
+    free_by_size = malloc(free_extent_capacity * sizeof(Extent));
+    if (!free_by_offset || !free_by_size) {
+        printf("ERROR: Cannot allocate free-extent index\n");
+        exit(EXIT_FAILURE);
+    }
+    free_by_offset[0].start = 0;
+    free_by_offset[0].count = max_clusters;
+    free_by_size[0] = free_by_offset[0];
+    free_extent_count = max_clusters > 0 ? 1 : 0;
 }
 
-// Initialize the pseudo file system
-void initialize_filesystem() {
-    file_count = 0;
-    memset(filesystem, 0, sizeof(filesystem));
-    strcpy(current_path, "/");
-    initialize_fat();
+void mark_cluster_used(int cluster) {
+    uint64_t bit = UINT64_C(1) << (cluster % 64);
+    if (free_bitmap[cluster / 64] & bit) {
+        free_bitmap[cluster / 64] &= ~bit;
+        free_cluster_count--;
+    }
 }
 
-// Allocate clusters for a file
-int allocate_cluster(FileEntry *file_entry) {
-    size_t clusters_needed = (file_entry->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
-    printf("Allocating %zu clusters for file of size %zu bytes\n", clusters_needed, file_entry->size);
-    if (count_free_clusters() < clusters_needed) {
-        return -1;  // Not enough space
+void mark_cluster_free(int cluster) {
+    uint64_t bit = UINT64_C(1) << (cluster % 64);
+    if (!(free_bitmap[cluster / 64] & bit)) {
+        free_bitmap[cluster / 64] |= bit;
+        free_cluster_count++;
     }
+}
 
-    int first_cluster = -1;
-    file_entry->end_cluster = -1; // Reset end_cluster before allocation
-
-    for (int i = 0; i < max_clusters && clusters_needed > 0; i++) {
-        if (fat[i] == FAT_FREE) {
-            if (first_cluster == -1) {
-                first_cluster = i; // First cluster
-                file_entry->start_cluster = first_cluster;
-            }
-
-            if (file_entry->end_cluster != -1) {
-                fat[file_entry->end_cluster] = i; // Link clusters
-            }
-
-            file_entry->end_cluster = i; // Update end_cluster
-            fat[i] = FAT_END;
-            clusters_needed--;
+// First position in free_by_offset whose extent starts at or after the cluster
+size_t free_offset_position(int start) {
+    size_t low = 0, high = free_extent_count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (free_by_offset[mid].start < start) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
     }
+    return low;
+}
 
-    // If there are still unallocated clusters, clean up
-    if (clusters_needed > 0) {
-        printf("NO FREE CLUSTERS\n");
-
-        // Free already allocated clusters
-        int current = first_cluster;
-        while (current != -1 && current != FAT_END) {
-            int next = fat[current];
-            fat[current] = FAT_FREE;
-            current = next;
+// First position in free_by_size that is not smaller than (count, start)
+size_t free_size_position(size_t count, int start) {
+    size_t low = 0, high = free_extent_count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (free_by_size[mid].count < count || (free_by_size[mid].count == count && free_by_size[mid].start < start)) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
-
-        file_entry->start_cluster = FAT_FREE; // Reset start_cluster
-        file_entry->end_cluster = FAT_FREE;   // Reset end_cluster
-        return -1;
     }
+    return low;
+}
 
-    return first_cluster;
+void free_index_remove(Extent extent) {
+    size_t by_offset = free_offset_position(extent.start);
+    size_t by_size = free_size_position(extent.count, extent.start);
+    memmove(&free_by_offset[by_offset], &free_by_offset[by_offset + 1],
+            (free_extent_count - by_offset - 1) * sizeof(Extent));
+    memmove(&free_by_size[by_size], &free_by_size[by_size + 1],
+            (free_extent_count - by_size - 1) * sizeof(Extent));
+    free_extent_count--;
 }
 
-// Find a file by name in the pseudo filesystem
-int find_file(const char *filename) {
-    for (size_t i = 0; i < file_count; i++) {
-        if (strcmp(filesystem[i].filename, filename) == 0) {
-            return i;
+void free_index_add(Extent extent) {
+    if (free_extent_count == free_extent_capacity) {
+        size_t capacity = free_extent_capacity * 2;
+        Extent *by_offset = realloc(free_by_offset, capacity * sizeof(Extent));
+        Extent *by_size = by_offset ? realloc(free_by_size, capacity * sizeof(Extent)) : NULL;
+        if (!by_offset || !by_size) {
+            printf("ERROR: Cannot grow free-extent index\n");
+            exit(EXIT_FAILURE);
         }
+        free_by_offset = by_offset;
+        free_by_size = by_size;
+        free_extent_capacity = capacity;
     }
-    return -1;
-}
 
-// Add a directory or file with the correct path
-void add_to_filesystem(const char *name, int is_directory) {
-    char full_path[MAX_PATH_LENGTH];
-    normalize_path(full_path, name);
+    size_t by_offset = free_offset_position(extent.start);
+    size_t by_size = free_size_position(extent.count, extent.start);
+    memmove(&free_by_offset[by_offset + 1], &free_by_offset[by_offset],
+            (free_extent_count - by_offset) * sizeof(Extent));
+    memmove(&free_by_size[by_size + 1], &free_by_size[by_size],
+            (free_extent_count - by_size) * sizeof(Extent));
+    free_by_offset[by_offset] = extent;
+    free_by_size[by_size] = extent;
+    free_extent_count++;
+}
 
-    if (find_file(full_path) != -1) {
-        printf("EXIST\n");
-        return;
+// Take up to wanted clusters as one contiguous run. When goal is a free cluster that starts a
+// free extent (the cluster after a file's tail), the run continues the file in place; otherwise
+// the smallest extent that holds the whole request is used, and only if none does, the largest
+// one. Extents are split only when they are bigger than the request. Returns 0 when nothing is free.
+int take_free_run(size_t wanted, int goal, Extent *run) {
+    if (free_extent_count == 0 || wanted == 0) {
+        return 0;
     }
 
-    if (file_count >= MAX_FILES) {
-        printf("Filesystem is full.\n");
-        return;
+    Extent chosen;
+    size_t position = goal >= 0 ? free_offset_position(goal) : free_extent_count;
+    if (position < free_extent_count && free_by_offset[position].start == goal) {
+        chosen = free_by_offset[position];
+    } else {
+        position = free_size_position(wanted, -1);
+        chosen = position < free_extent_count ? free_by_size[position] : free_by_size[free_extent_count - 1];
     }
 
-    FileEntry new_entry;
-    strncpy(new_entry.filename, full_path, MAX_PATH_LENGTH);
-    new_entry.size = 0;
-    new_entry.start_cluster = FAT_FREE;
-    new_entry.is_directory = is_directory;
-
-    // Ensure directory paths end with '/'
-    if (is_directory && full_path[strlen(full_path) - 1] != '/') {
-        strncat(new_entry.filename, "/", MAX_PATH_LENGTH - strlen(new_entry.filename) - 1);
+    free_index_remove(chosen);
+    run->start = chosen.start;
+    run->count = chosen.count < wanted ? chosen.count : wanted;
+    if (chosen.count > run->count) {
+        Extent rest = {chosen.start + (int)run->count, chosen.count - run->count};
+        free_index_add(rest);
     }
 
-    filesystem[file_count++] = new_entry;
-    printf("OK\n");
+    for (size_t i = 0; i < run->count; i++) {
+        mark_cluster_used(run->start + (int)i);
+    }
+    return 1;
 }
 
-// List files in a directory
-void ls(const char *dirname) {
-    char target_path[MAX_PATH_LENGTH];
-    if (dirname == NULL || strcmp(dirname, "") == 0 || strcmp(dirname, "ls") == 0) {
-        strncpy(target_path, current_path, MAX_PATH_LENGTH);
-    } else {
-        normalize_path(target_path, dirname);
-    }
+// Return a run of clusters to the free space, merging it with free neighbours on both sides
+void release_run(int start, size_t count) {
+    Extent merged = {start, count};
+    size_t position = free_offset_position(start);
 
-    size_t target_len = strlen(target_path);
-    if (target_path[target_len - 1] != '/') {
-        strncat(target_path, "/", MAX_PATH_LENGTH - target_len - 1);
-        target_len++;
+    if (position < free_extent_count && free_by_offset[position].start == start + (int)count) {
+        Extent right = free_by_offset[position];
+        free_index_remove(right);
+        merged.count += right.count;
     }
-
-    int found = 0;
-    int dir_exists = 0;
-
-    // Check if the directory exists
-    for (size_t i = 0; i < file_count; i++) {
-        if (strcmp(filesystem[i].filename, target_path) == 0 && filesystem[i].is_directory) {
-            dir_exists = 1;
-            break;
-        }
+    if (position > 0 && free_by_offset[position - 1].start + (int)free_by_offset[position - 1].count == start) {
+        Extent left = free_by_offset[position - 1];
+        free_index_remove(left);
+        merged.start = left.start;
+        merged.count += left.count;
     }
+    free_index_add(merged);
 
-    // Check if the directory contains any files or subdirectories
-    for (size_t i = 0; i < file_count; i++) {
-        if (strncmp(filesystem[i].filename, target_path, target_len) == 0) {
-            dir_exists = 1;
-            break;
-        }
+    for (size_t i = 0; i < count; i++) {
+        mark_cluster_free(start + (int)i);
     }
+}
 
-    if (!dir_exists) {
-        printf("PATH NOT FOUND\n");
-        return;
+// Number of contiguous runs the file's chain is made of
+size_t count_extents(int start_cluster) {
+    size_t extents = 0;
+    Extent extent;
+    while (next_extent(&start_cluster, max_clusters, &extent)) {
+        extents++;
     }
+    return extents;
+}
 
-    // Print directory contents
-    for (size_t i = 0; i < file_count; i++) {
-        if (strncmp(filesystem[i].filename, target_path, target_len) == 0) {
-            const char *subpath = filesystem[i].filename + target_len;
+// Initialize the pseudo file system
+void initialize_filesystem() {
+    entry_store_reset();
+    file_count = 0;
+    name_table_reset();
+    dentry_invalidate();
+    directory_table.size = 0;
+    directory_table.start_cluster = FAT_FREE;
+    directory_table.end_cluster = FAT_FREE;
+    directory_clusters = 0;
+    directory_entries = 0;
+    directory_record_bytes = 0;
+    path_index_rebuild();
+    root_first_child = root_last_child = -1;
+    current_dir = -1;
+    strcpy(current_path, "/");
+    initialize_fat();
+}
 
-            if (strlen(subpath) == 0) {
-                continue;
-            }
+// Allocate clusters for a file
+int allocate_cluster(FileEntry *file_entry) {
+    size_t clusters_needed = (file_entry->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    printf("Allocating %zu clusters for file of size %zu bytes\n", clusters_needed, file_entry->size);
 
-            printf("%s: %s\n", filesystem[i].is_directory ? "DIR" : "FILE", subpath);
-            found = 1;
-        }
+    file_entry->start_cluster = FAT_FREE;
+    file_entry->end_cluster = FAT_FREE; // Reset end_cluster before allocation
+    if (clusters_needed == 0) {
+        return -1;
     }
 
-    if (!found) {
-        printf("EMPTY\n");
+    int first_cluster = extend_chain(file_entry, clusters_needed);
+    if (first_cluster != -1) {
+        printf("Allocated in %zu extent(s)\n", count_extents(first_cluster));
     }
+    return first_cluster;
 }
 
-// Function to change current directory
-void cd(const char *dirname) {
-    if (!dirname || strlen(dirname) == 0) {
-        printf("INVALID ARGUMENT\n");
-        return;
-    }
+// Bytes of the directory record for an entry called name
+size_t record_size(const char *name) {
+    return sizeof(DirectoryRecord) + strlen(name);
+}
 
-    char new_path[MAX_PATH_LENGTH];
-    normalize_path(new_path, dirname);
+// Clusters the directory table still has to grow by to hold every live record plus extra bytes
+size_t directory_shortfall(size_t extra) {
+    size_t needed = (directory_record_bytes + extra + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    return needed > directory_clusters ? needed - directory_clusters : 0;
+}
 
-    // cd /
-    if (strcmp(dirname, "/") == 0) {
-        strcpy(current_path, "/");
-        printf("OK - current path: /\n");
-        return;
+// Whether clusters more data clusters still leave the directory table room for record_bytes
+// more bytes of records. The table only grows in write_metadata, so every command that adds
+// entries or names checks this first instead of running the disk out from under it.
+int table_fits(size_t clusters, size_t record_bytes) {
+    return (size_t)count_free_clusters() >= clusters + directory_shortfall(record_bytes);
+}
+
+// Link the given number of free clusters after the file's end_cluster (or as its whole chain
+// when it has none). Nothing is allocated unless all of them fit, next to the clusters the
+// directory table needs for the records already there.
+// Returns the first new cluster, or -1 when there is not enough space.
+int extend_chain(FileEntry *file, size_t clusters) {
+    size_t reserved = file == &directory_table ? 0 : directory_shortfall(0);
+    if ((size_t)count_free_clusters() < clusters + reserved) {
+        return -1;  // Not enough space
     }
 
-    // cd .. | cd ../
-    if (strcmp(dirname, "..") == 0 || strcmp(dirname, "../") == 0) {
-        if (strcmp(current_path, "/") == 0) {
-            printf("OK - current path: /\n");
-            return;
+    int first_cluster = -1;
+    Extent run;
+    while (clusters > 0) {
+        // Prefer the clusters right after the current tail, then the best-fitting free extent
+        int goal = file->start_cluster == FAT_FREE ? -1 : (int)file->end_cluster + 1;
+        take_free_run(clusters, goal, &run);
+
+        if (first_cluster == -1) {
+            first_cluster = run.start; // First new cluster
         }
 
-        // first/last slash
-        char *last_slash = strrchr(current_path, '/');
-        if (last_slash && last_slash != current_path) {
-            char *second_last_slash = NULL;
-            for (char *p = current_path; p < last_slash; p++) {
-                if (*p == '/') {
-                    second_last_slash = p;
-                }
-            }
-
-            if (second_last_slash) {
-                *second_last_slash = '\0';
-            } else {
-                strcpy(current_path, "/");  // root
-            }
+        if (file->start_cluster == FAT_FREE) {
+            file->start_cluster = run.start;
         } else {
-            strcpy(current_path, "/");  //root
+            fat[file->end_cluster] = run.start; // Link clusters
         }
 
-        if (current_path[strlen(current_path) - 1] != '/') {
-            strcat(current_path, "/");
+        for (size_t i = 0; i < run.count; i++) {
+            int c = run.start + (int)i;
+            fat[c] = i + 1 < run.count ? c + 1 : FAT_END;
+            cluster_refs[c] = 1;   // Referenced by the file start or by the previous cluster
         }
-        printf("OK - current path123: %s\n", current_path);
-        return;
+        file->end_cluster = run.start + run.count - 1; // Update end_cluster
+        extent_map_append(file, run.start, run.count);
+        clusters -= run.count;
     }
 
-    // cd ../..
-    if (strncmp(dirname, "../", 3) == 0) {
-        cd("..");
-        cd(dirname + 3);  // Рекурсивно вызываем `cd` для оставшейся части пути
-        return;
-    }
+    return first_cluster;
+}
 
-    int dir_index = find_file(new_path);
-    if (dir_index == -1 || !filesystem[dir_index].is_directory) {
-        printf("PATH NOT FOUND\n");
-        return;
+// FNV-1a over the name, seeded with the parent, with a final avalanche: names are short, so
+// per-byte mixing beats block hashes here
+uint32_t hash_entry(int parent, const char *name) {
+    uint32_t hash = 2166136261u ^ ((uint32_t)(parent + 1) * 0x9e3779b1u);
+    while (*name) {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
     }
+    hash ^= hash >> 15;
+    hash *= 0x2c1b3c6du;
+    hash ^= hash >> 12;
+    return hash;
+}
 
-    strncpy(current_path, new_path, MAX_PATH_LENGTH);
+void path_index_place(uint32_t hash, int index) {
+    size_t mask = path_index_capacity - 1;
+    size_t slot = hash & mask;
+    while (path_index[slot].index != -1) {
+        slot = (slot + 1) & mask;
+    }
+    path_index[slot].hash = hash;
+    path_index[slot].index = index;
+}
 
-    if (current_path[strlen(current_path) - 1] != '/') {
-        strcat(current_path, "/");
+// Size the index for file_count entries (plus room to grow) and re-add all of them
+void path_index_rebuild() {
+    size_t capacity = 64;
+    while (capacity < file_count * 2 + 2) {
+        capacity *= 2;
     }
 
-    printf("OK - current path: %s\n", current_path);
+    PathSlot *slots = malloc(capacity * sizeof(PathSlot));
+    if (!slots) {
+        printf("ERROR: Cannot allocate path index\n");
+        exit(EXIT_FAILURE);
+    }
+    free(path_index);
+    path_index = slots;
+    path_index_capacity = capacity;
+    for (size_t i = 0; i < capacity; i++) {
+        path_index[i].index = -1;
+    }
+    for (size_t i = 0; i < file_count; i++) {
+        if (!entry_is_free(i)) {
+            path_index_place(hash_entry(entry_at(i)->parent, entry_at(i)->name), (int)i);
+        }
+    }
 }
 
-// Function to print current working directory
-void pwd() {
-    printf("%s\n", current_path);
+// Slot holding the entry at the given position (found through its current parent and name)
+size_t path_index_slot(size_t index) {
+    size_t mask = path_index_capacity - 1;
+    size_t slot = hash_entry(entry_at(index)->parent, entry_at(index)->name) & mask;
+    while (path_index[slot].index != (int)index) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
 }
 
-void create_directory(const char *dirname) {
-    char full_path[MAX_PATH_LENGTH];
-    normalize_path(full_path, dirname);
-
-    if (find_file(full_path) != -1) {  // Check if directory already exists
-        printf("DIRECTORY ALREADY EXISTS\n");
-        return;
+// Empty a slot and shift later members of its probe run back, so lookups never need tombstones
+void path_index_erase(size_t slot) {
+    size_t mask = path_index_capacity - 1;
+    size_t hole = slot;
+    for (size_t next = (hole + 1) & mask; path_index[next].index != -1; next = (next + 1) & mask) {
+        size_t home = path_index[next].hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            path_index[hole] = path_index[next];
+            hole = next;
+        }
     }
+    path_index[hole].index = -1;
+}
 
-    // Ensure directory paths end with '/'
-    if (full_path[strlen(full_path) - 1] != '/') {
-        strncat(full_path, "/", MAX_PATH_LENGTH - strlen(full_path) - 1);
+// Entry called name inside directory dir (-1 for the root), or -1
+int find_child(int dir, const char *name) {
+    if (!path_index) {
+        return -1;
     }
-
-    if (file_count >= MAX_FILES) {
-        printf("Filesystem is full.\n");
-        return;
+    uint32_t hash = hash_entry(dir, name);
+    size_t mask = path_index_capacity - 1;
+    for (size_t slot = hash & mask; path_index[slot].index != -1; slot = (slot + 1) & mask) {
+        const FileEntry *entry = entry_at(path_index[slot].index);
+        if (path_index[slot].hash == hash && entry->parent == dir && strcmp(entry->name, name) == 0) {
+            return path_index[slot].index;
+        }
     }
-
-    FileEntry new_entry;
-    strncpy(new_entry.filename, full_path, MAX_PATH_LENGTH);
-    new_entry.size = 0;
-    new_entry.start_cluster = FAT_FREE;
-    new_entry.is_directory = 1;
-
-    filesystem[file_count++] = new_entry;
-    printf("OK\n");
+    return -1;
 }
 
-int remove_directory(const char *dirname) {
-    char full_path[MAX_PATH_LENGTH];
-    normalize_path(full_path, dirname);
+void dentry_invalidate() {
+    dentry_generation++;
+}
 
-    int dir_index = find_file(full_path);
-    if (dir_index == -1 || !filesystem[dir_index].is_directory) {
-        printf("DIRECTORY NOT FOUND\n");
+// Entry reached by the first length bytes of path (-1 for the root, NO_PARENT if there is
+// none). The last component is looked up in its directory, which comes from the cache or a
+// recursive resolve of the prefix, so a miss below a cached directory costs one lookup.
+int resolve_path(const char *path, size_t length) {
+    while (length > 0 && path[length - 1] == '/') {
+        length--;
+    }
+    if (length == 0) {
         return -1;
     }
 
-    // recursively deleting files
-    for (size_t i = 0; i < file_count; ) {
-        if (strncmp(filesystem[i].filename, full_path, strlen(full_path)) == 0 &&
-            strlen(filesystem[i].filename) > strlen(full_path)) {
-
-            if (filesystem[i].is_directory) {
-                remove_directory(filesystem[i].filename); // recursively deleting subfiles
-            } else {
-                free_clusters(&filesystem[i]);
-            }
+    uint32_t hash = hash_name(path, length);
+    DentrySlot *slot = &dentry_cache[hash & (DENTRY_CACHE_SIZE - 1)];
+    if (slot->generation == dentry_generation && slot->hash == hash && slot->length == length &&
+        memcmp(slot->path, path, length) == 0) {
+        return slot->index;
+    }
 
-            for (size_t j = i; j < file_count - 1; j++) {
-                filesystem[j] = filesystem[j + 1];
-            }
-            file_count--;
-            } else {
-                i++;
-            }
+    size_t start = length;
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+    int dir = resolve_path(path, start);
+    if (dir == NO_PARENT || (dir != -1 && !entry_at(dir)->is_directory)) {
+        return NO_PARENT;
     }
 
-    // deleting dir
-    for (size_t i = dir_index; i < file_count - 1; i++) {
-        filesystem[i] = filesystem[i + 1];
+    const char *name = path + start;
+    size_t name_length = length - start;
+    int index;
+    if (name_length == 1 && name[0] == '.') {
+        index = dir;
+    } else if (name_length == 2 && name[0] == '.' && name[1] == '.') {
+        index = dir == -1 ? -1 : entry_at(dir)->parent;
+    } else {
+        char component[MAX_PATH_LENGTH];
+        memcpy(component, name, name_length);
+        component[name_length] = '\0';
+        index = find_child(dir, component);
+        if (index == -1) {
+            return NO_PARENT;
+        }
     }
-    file_count--;
 
-    printf("OK - %s removed\n",dirname);
-    return 0;
+    if (index != -1) {
+        slot->hash = hash;
+        slot->generation = dentry_generation;
+        slot->index = index;
+        slot->length = length;
+        memcpy(slot->path, path, length);
+    }
+    return index;
 }
 
-// Function to copy a file in the pseudo filesystem
-void cp(const char *args) {
-    if (!args || strlen(args) == 0) {
-        printf("INVALID ARGUMENTS\n");
-        return;
+// Find a file by name in the pseudo filesystem through the path cache.
+// A trailing '/' only matches directories; the root itself has no entry.
+int find_file(const char *filename) {
+    size_t length = strlen(filename);
+    if (length >= MAX_PATH_LENGTH) {
+        return -1;
     }
+    int index = resolve_path(filename, length);
+    if (index == NO_PARENT) {
+        return -1;
+    }
+    if (index != -1 && length > 0 && filename[length - 1] == '/' && !entry_at(index)->is_directory) {
+        return -1;
+    }
+    return index;
+}
 
-    char source[MAX_PATH_LENGTH], destination[MAX_PATH_LENGTH];
-
-    int parsed = sscanf(args, "%s %s", source, destination);
-    if (parsed != 2) {
-        printf("INVALID ARGUMENTS\n");
-        return;
+// find_file returns -1 both for the root, which has no entry, and for a miss; commands that take
+// a directory ask here instead. Returns 1 and sets *dir (-1 for the root) when the path names a
+// directory, 0 when it does not.
+int find_directory(const char *path, int *dir) {
+    size_t length = strlen(path);
+    if (length >= MAX_PATH_LENGTH) {
+        return 0;
+    }
+    int index = resolve_path(path, length);
+    if (index == NO_PARENT || (index != -1 && !entry_at(index)->is_directory)) {
+        return 0;
     }
+    *dir = index;
+    return 1;
+}
 
-    char src_path[MAX_PATH_LENGTH], dest_path[MAX_PATH_LENGTH];
-    normalize_path(src_path, source);
-    normalize_path(dest_path, destination);
+// Split a path into the directory that should hold it (-1 for the root) and its last
+// component. Returns NO_PARENT when that directory does not exist or there is no component.
+int resolve_parent(const char *path, char *name) {
+    char parent_path[MAX_PATH_LENGTH];
+    strncpy(parent_path, path, MAX_PATH_LENGTH);
+    parent_path[MAX_PATH_LENGTH - 1] = '\0';
 
-    int src_index = find_file(src_path);
-    if (src_index == -1) {
-        printf("FILE NOT FOUND\n");
-        return;
+    size_t length = strlen(parent_path);
+    while (length > 0 && parent_path[length - 1] == '/') {
+        parent_path[--length] = '\0';
     }
+    char *last_slash = strrchr(parent_path, '/');
+    const char *last = last_slash ? last_slash + 1 : parent_path;
+    if (*last == '\0' || strcmp(last, ".") == 0 || strcmp(last, "..") == 0) {
+        return NO_PARENT;
+    }
+    strcpy(name, last);
 
-    FileEntry *src_entry = &filesystem[src_index];
-
-    // if destination exists
-    int dest_index = find_file(dest_path);
-    if (dest_index != -1 && filesystem[dest_index].is_directory) {
-        snprintf(dest_path, MAX_PATH_LENGTH, "%s/%s", dest_path, strrchr(src_path, '/') ? strrchr(src_path, '/') + 1 : src_path);
-        normalize_path(dest_path, dest_path); // Убираем двойные слэши
+    if (!last_slash || last_slash == parent_path) {
+        return -1;
     }
+    last_slash[1] = '\0';
+    int parent;
+    return find_directory(parent_path, &parent) ? parent : NO_PARENT;
+}
 
-    // if file or dir exists
-    if (find_file(dest_path) != -1) {
-        printf("DESTINATION FILE OR DIRECTORY ALREADY EXISTS\n");
-        return;
+// Full path of an entry, rebuilt from the tree; directories end with '/' like current_path
+void entry_path(int index, char *path) {
+    int chain[MAX_PATH_LENGTH / 2];
+    size_t depth = 0;
+    for (int e = index; e != -1 && depth < MAX_PATH_LENGTH / 2; e = entry_at(e)->parent) {
+        chain[depth++] = e;
     }
 
-    if (file_count >= MAX_FILES) {
-        printf("Filesystem is full.\n");
-        return;
+    size_t length = 1;
+    strcpy(path, "/");
+    while (depth > 0 && length < MAX_PATH_LENGTH) {
+        const FileEntry *entry = entry_at(chain[--depth]);
+        length += (size_t)snprintf(path + length, MAX_PATH_LENGTH - length, "%s%s", entry->name,
+                                   entry->is_directory ? "/" : "");
     }
+}
 
-    if (!src_entry->is_directory) {
-        FileEntry new_file;
-        strncpy(new_file.filename, dest_path, MAX_PATH_LENGTH);
-        new_file.size = src_entry->size;
-        new_file.is_directory = 0;
-
-        if (src_entry->size == 0) {
-            new_file.start_cluster = FAT_FREE;
-        } else {
-            new_file.start_cluster = allocate_cluster(&new_file);
-            if (new_file.start_cluster == -1) {
-                printf("NO FREE CLUSTERS\n");
-                return;
+// Longest path below dir as entry_path spells it: the names under dir, each directory followed by '/'
+size_t subtree_path_length(int dir) {
+    size_t longest = 0, length = 0;
+    int e = entry_at(dir)->first_child;
+    while (e != -1) {
+        length += strlen(entry_at(e)->name) + entry_at(e)->is_directory;
+        if (length > longest) {
+            longest = length;
+        }
+        if (entry_at(e)->first_child != -1) {
+            e = entry_at(e)->first_child;
+            continue;
+        }
+        // Climb back up to the next entry that still has a sibling to visit
+        while (e != dir) {
+            length -= strlen(entry_at(e)->name) + entry_at(e)->is_directory;
+            if (entry_at(e)->next_sibling != -1) {
+                break;
             }
+            e = entry_at(e)->parent;
+        }
+        e = e == dir ? -1 : entry_at(e)->next_sibling;
+    }
+    return longest;
+}
+
+// Whether every path in the subtree at index stays shorter than MAX_PATH_LENGTH once it is
+// called name under parent. Paths are rebuilt from the tree, so one that does not fit could
+// no longer be looked up.
+int subtree_path_fits(int index, int parent, const char *name) {
+    char parent_path[MAX_PATH_LENGTH] = "/";
+    if (parent != -1) {
+        entry_path(parent, parent_path);
+    }
+    size_t length = strlen(parent_path) + strlen(name) + entry_at(index)->is_directory;
+    if (entry_at(index)->is_directory) {
+        length += subtree_path_length(index);
+    }
+    return length < MAX_PATH_LENGTH;
+}
+
+// Head and tail of a directory's child list
+int *first_child_of(int dir) {
+    return dir == -1 ? &root_first_child : &entry_at(dir)->first_child;
+}
+
+int *last_child_of(int dir) {
+    return dir == -1 ? &root_last_child : &entry_at(dir)->last_child;
+}
+
+// Append the entry to the children of parent, so listings keep creation order
+void tree_link(int index, int parent) {
+    FileEntry *entry = entry_at(index);
+    int *last = last_child_of(parent);
+    entry->parent = parent;
+    entry->prev_sibling = *last;
+    entry->next_sibling = -1;
+    if (*last == -1) {
+        *first_child_of(parent) = index;
+    } else {
+        entry_at(*last)->next_sibling = index;
+    }
+    *last = index;
+}
+
+// Take the entry out of its parent's child list; its parent link is left for the caller
+void tree_unlink(int index) {
+    FileEntry *entry = entry_at(index);
+    if (entry->prev_sibling == -1) {
+        *first_child_of(entry->parent) = entry->next_sibling;
+    } else {
+        entry_at(entry->prev_sibling)->next_sibling = entry->next_sibling;
+    }
+    if (entry->next_sibling == -1) {
+        *last_child_of(entry->parent) = entry->prev_sibling;
+    } else {
+        entry_at(entry->next_sibling)->prev_sibling = entry->prev_sibling;
+    }
+    entry->prev_sibling = entry->next_sibling = -1;
+}
 
-            int src_cluster = src_entry->start_cluster;
-            int dest_cluster = new_file.start_cluster;
-            char buffer[CLUSTER_SIZE];
+// Rebuild the child lists from the parent links; after mount, when children may precede
+// their parents in the table
+void tree_rebuild() {
+    root_first_child = root_last_child = -1;
+    for (size_t i = 0; i < file_count; i++) {
+        entry_at(i)->first_child = entry_at(i)->last_child = -1;
+    }
+    for (size_t i = 0; i < file_count; i++) {
+        if (!entry_is_free(i)) {
+            tree_link((int)i, entry_at(i)->parent);
+        }
+    }
+}
+
+FileEntry *entry_at(int handle) {
+    return &entry_slabs[handle >> ENTRY_SLAB_SHIFT][handle & (ENTRY_SLAB_SIZE - 1)];
+}
+
+// Make room for count entries. Slabs past the one holding the last entry are released
+// (one spare is kept so that a remove/insert pair at a boundary does not thrash).
+void entry_store_reserve(size_t count) {
+    size_t needed = (count + ENTRY_SLAB_SIZE - 1) >> ENTRY_SLAB_SHIFT;
+    if (needed > entry_slab_capacity) {
+        size_t capacity = entry_slab_capacity ? entry_slab_capacity * 2 : 8;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        FileEntry **slabs = realloc(entry_slabs, capacity * sizeof(FileEntry *));
+        if (!slabs) {
+            printf("ERROR: Cannot allocate entry table\n");
+            exit(EXIT_FAILURE);
+        }
+        entry_slabs = slabs;
+        entry_slab_capacity = capacity;
+    }
+    while (entry_slab_count < needed) {
+        entry_slabs[entry_slab_count] = malloc(ENTRY_SLAB_SIZE * sizeof(FileEntry));
+        if (!entry_slabs[entry_slab_count]) {
+            printf("ERROR: Cannot allocate entry table\n");
+            exit(EXIT_FAILURE);
+        }
+        entry_slab_count++;
+    }
+    while (entry_slab_count > needed + 1) {
+        free(entry_slabs[--entry_slab_count]);
+    }
+}
 
-            while (src_cluster != FAT_END) {
-                read_cluster_data(src_cluster, buffer, CLUSTER_SIZE);
-                write_cluster_data(dest_cluster, buffer, CLUSTER_SIZE);
+void entry_store_reset() {
+    for (size_t i = 0; i < file_count; i++) {
+        extent_map_drop(entry_at((int)i));
+    }
+    while (entry_slab_count > 0) {
+        free(entry_slabs[--entry_slab_count]);
+    }
+    free_entry_head = -1;
+    free_entry_count = 0;
+}
 
-                int next_dest_cluster = fat[dest_cluster];
-                if (next_dest_cluster == FAT_END) break;
+int entry_is_free(size_t index) {
+    return entry_at((int)index)->name == NULL;
+}
+
+uint32_t hash_name(const char *name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
 
-                dest_cluster = next_dest_cluster;
-                src_cluster = fat[src_cluster];
+// Copy of name (length bytes, not necessarily terminated) in the name chunks
+char *name_chunk_alloc(const char *name, size_t length) {
+    if (name_chunk_count == 0 || name_chunk_used + length + 1 > NAME_CHUNK_SIZE) {
+        if (name_chunk_count == name_chunk_capacity) {
+            size_t capacity = name_chunk_capacity ? name_chunk_capacity * 2 : 8;
+            char **chunks = realloc(name_chunks, capacity * sizeof(char *));
+            if (!chunks) {
+                printf("ERROR: Cannot allocate name table\n");
+                exit(EXIT_FAILURE);
             }
+            name_chunks = chunks;
+            name_chunk_capacity = capacity;
         }
+        size_t size = length + 1 > NAME_CHUNK_SIZE ? length + 1 : NAME_CHUNK_SIZE;  // long names get a chunk of their own
+        name_chunks[name_chunk_count] = malloc(size);
+        if (!name_chunks[name_chunk_count]) {
+            printf("ERROR: Cannot allocate name table\n");
+            exit(EXIT_FAILURE);
+        }
+        name_chunk_count++;
+        name_chunk_used = 0;
+    }
+    char *copy = name_chunks[name_chunk_count - 1] + name_chunk_used;
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    name_chunk_used += length + 1;
+    return copy;
+}
 
-        filesystem[file_count++] = new_file;
-        // printf("Copied file: %s -> %s\n", src_path, dest_path);
-        printf("OK\n");
-        return;
+void name_table_grow() {
+    size_t capacity = name_table_capacity ? name_table_capacity * 2 : 256;
+    NameSlot *slots = calloc(capacity, sizeof(NameSlot));
+    if (!slots) {
+        printf("ERROR: Cannot allocate name table\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < name_table_capacity; i++) {
+        if (name_table[i].name) {
+            size_t slot = name_table[i].hash & (capacity - 1);
+            while (slots[slot].name) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            slots[slot] = name_table[i];
+        }
     }
+    free(name_table);
+    name_table = slots;
+    name_table_capacity = capacity;
+}
 
-    printf("Copying directory %s -> %s\n", src_path, dest_path);
-    add_to_filesystem(dest_path, 1);
+// The shared copy of a name component, added on first use. Every call takes a reference for the
+// entry that will hold the name; name_release gives it back.
+const char *intern_name(const char *name, size_t length) {
+    if ((name_table_count + 1) * 2 > name_table_capacity) {
+        name_table_grow();
+    }
+    uint32_t hash = hash_name(name, length);
+    size_t mask = name_table_capacity - 1;
+    size_t slot = hash & mask;
+    for (; name_table[slot].name; slot = (slot + 1) & mask) {
+        if (name_table[slot].hash == hash && strncmp(name_table[slot].name, name, length) == 0 &&
+            name_table[slot].name[length] == '\0') {
+            if (name_table[slot].refs++ == 0) {
+                name_dead_bytes -= length + 1;
+                name_live_bytes += length + 1;
+            }
+            return name_table[slot].name;
+        }
+    }
+    name_table[slot].hash = hash;
+    name_table[slot].refs = 1;
+    name_table[slot].name = name_chunk_alloc(name, length);
+    name_table_count++;
+    name_live_bytes += length + 1;
+    return name_table[slot].name;
+}
+
+// Drop the reference an entry held on its interned name
+void name_release(const char *name) {
+    size_t length = strlen(name);
+    size_t mask = name_table_capacity - 1;
+    size_t slot = hash_name(name, length) & mask;
+    while (name_table[slot].name != name) {
+        slot = (slot + 1) & mask;
+    }
+    if (--name_table[slot].refs == 0) {
+        name_live_bytes -= length + 1;
+        name_dead_bytes += length + 1;
+    }
+}
+
+void name_table_reset() {
+    while (name_chunk_count > 0) {
+        free(name_chunks[--name_chunk_count]);
+    }
+    name_chunk_used = 0;
+    free(name_table);
+    name_table = NULL;
+    name_table_capacity = 0;
+    name_table_count = 0;
+    name_live_bytes = name_dead_bytes = 0;
+}
 
-    if (src_path[strlen(src_path) - 1] == '/') {
-        src_path[strlen(src_path) - 1] = '\0';
+// Re-intern the names of live entries into fresh chunks and free the old ones. Entries keep
+// pointers into the chunks, so this only runs between commands.
+void name_table_collect() {
+    char **old_chunks = name_chunks;
+    size_t old_count = name_chunk_count;
+    name_chunks = NULL;
+    name_chunk_count = name_chunk_capacity = name_chunk_used = 0;
+    free(name_table);
+    name_table = NULL;
+    name_table_capacity = name_table_count = 0;
+    name_live_bytes = name_dead_bytes = 0;
+
+    for (size_t i = 0; i < file_count; i++) {
+        if (entry_is_free(i)) {
+            continue;
+        }
+        FileEntry *entry = entry_at((int)i);
+        entry->name = intern_name(entry->name, strlen(entry->name));
     }
+    while (old_count > 0) {
+        free(old_chunks[--old_count]);
+    }
+    free(old_chunks);
+}
 
-    size_t src_len = strlen(src_path);
+int compact_link(const int *remap, int link) {
+    return link == -1 ? -1 : remap[link];
+}
 
+// Slide live entries down over the tombstones in one pass and renumber every tree link.
+// Handles change, so this only runs between commands and before the table is written out.
+void entry_store_compact() {
+    if (free_entry_count == 0) {
+        return;
+    }
+    int *remap = malloc(file_count * sizeof(int));
+    if (!remap) {
+        printf("ERROR: Cannot allocate entry table\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t live = 0;
     for (size_t i = 0; i < file_count; i++) {
-        // preventing cycle
-        if (strcmp(filesystem[i].filename, src_path) == 0 || strcmp(filesystem[i].filename, dest_path) == 0) {
+        if (entry_is_free(i)) {
+            remap[i] = -1;
             continue;
         }
+        remap[i] = (int)live;
+        if (live != i) {
+            *entry_at((int)live) = *entry_at((int)i);
+        }
+        live++;
+    }
+    for (size_t i = 0; i < live; i++) {
+        FileEntry *entry = entry_at((int)i);
+        entry->parent = compact_link(remap, entry->parent);
+        entry->first_child = compact_link(remap, entry->first_child);
+        entry->last_child = compact_link(remap, entry->last_child);
+        entry->prev_sibling = compact_link(remap, entry->prev_sibling);
+        entry->next_sibling = compact_link(remap, entry->next_sibling);
+    }
+    root_first_child = compact_link(remap, root_first_child);
+    root_last_child = compact_link(remap, root_last_child);
+    current_dir = compact_link(remap, current_dir);
+    free(remap);
+
+    file_count = live;
+    free_entry_head = -1;
+    free_entry_count = 0;
+    entry_store_reserve(file_count);
+    name_table_collect();
+    path_index_rebuild();
+    dentry_invalidate();
+}
+
+// Compact once tombstones make up half of the table (and there are enough to be worth it).
+// Unused names are collected on their own terms, since renames leave no tombstones.
+void entry_store_maybe_compact() {
+    if (free_entry_count >= ENTRY_COMPACT_MIN && free_entry_count * 2 >= file_count) {
+        entry_store_compact();
+    } else if (name_dead_bytes >= NAME_CHUNK_SIZE && name_dead_bytes > name_live_bytes) {
+        name_table_collect();
+    }
+}
+
+// Add an entry (its name and parent already set) to the table, the path index and its
+// parent directory, reusing a tombstone when there is one; returns its position
+int insert_entry(const FileEntry *entry) {
+    int index;
+    if (free_entry_head != -1) {
+        index = free_entry_head;
+        free_entry_head = entry_at(index)->next_sibling;
+        free_entry_count--;
+    } else {
+        if ((file_count + 1) * 2 > path_index_capacity) {
+            path_index_rebuild();
+        }
+        entry_store_reserve(file_count + 1);
+        index = (int)file_count++;
+    }
+    *entry_at(index) = *entry;
+    entry_at(index)->name = intern_name(entry->name, strlen(entry->name));
+    entry_at(index)->extents = NULL;  // a clone shares the chain, not the map
+    entry_at(index)->first_child = entry_at(index)->last_child = -1;
+    path_index_place(hash_entry(entry->parent, entry_at(index)->name), index);
+    tree_link(index, entry->parent);
+    directory_record_bytes += record_size(entry->name);
+    return index;
+}
+
+// Drop the entry at index (a file or an empty directory) by turning it into a tombstone.
+// Nothing else moves, so the other handles and path index keys stay valid.
+void remove_entry(size_t index) {
+    if ((int)index == current_dir) {
+        current_dir = -1;
+        strcpy(current_path, "/");
+    }
+    path_index_erase(path_index_slot(index));
+    tree_unlink((int)index);
+    dentry_invalidate();
+
+    FileEntry *entry = entry_at((int)index);
+    directory_record_bytes -= record_size(entry->name);
+    extent_map_drop(entry);
+    name_release(entry->name);
+    memset(entry, 0, sizeof(*entry));
+    entry->start_cluster = FAT_FREE;
+    entry->end_cluster = FAT_FREE;
+    entry->parent = entry->first_child = entry->last_child = entry->prev_sibling = -1;
+    entry->next_sibling = free_entry_head;
+    free_entry_head = (int)index;
+    free_entry_count++;
+}
 
-        if (strncmp(filesystem[i].filename, src_path, src_len) == 0 &&
-            filesystem[i].filename[src_len] == '/') {
+// Move the entry under parent with a new name. Descendants derive their paths from the tree,
+// so a directory moves with its whole subtree at the cost of one entry.
+void rename_entry(size_t index, int parent, const char *name) {
+    path_index_erase(path_index_slot(index));
+    tree_unlink((int)index);
+    dentry_invalidate();
+    const char *old_name = entry_at(index)->name;
+    directory_record_bytes += strlen(name) - strlen(old_name);
+    entry_at(index)->name = intern_name(name, strlen(name));
+    name_release(old_name);
+    entry_at(index)->parent = parent;
+    path_index_place(hash_entry(parent, entry_at(index)->name), (int)index);
+    tree_link((int)index, parent);
+
+    if (current_dir != -1) {
+        entry_path(current_dir, current_path);  // the working directory may have moved
+    }
+}
 
-            printf("copying files...\n");
+// Add a directory or file with the correct path
+void add_to_filesystem(const char *name, int is_directory) {
+    char full_path[MAX_PATH_LENGTH];
+    normalize_path(full_path, name);
 
-            char new_dest[MAX_PATH_LENGTH];
-            snprintf(new_dest, MAX_PATH_LENGTH, "%s%s", dest_path, filesystem[i].filename + src_len);
-            normalize_path(new_dest, new_dest); // Убираем двойные слэши
+    if (find_file(full_path) != -1) {
+        printf("EXIST\n");
+        return;
+    }
 
-            char sub_args[MAX_PATH_LENGTH * 2];
-            snprintf(sub_args, sizeof(sub_args), "%s %s", filesystem[i].filename, new_dest);
+    char component[MAX_PATH_LENGTH];
+    FileEntry new_entry = {0};
+    new_entry.parent = resolve_parent(full_path, component);
+    new_entry.name = component;
+    if (new_entry.parent == NO_PARENT) {
+        printf("PATH NOT FOUND\n");
+        return;
+    }
+    if (!table_fits(0, record_size(component))) {
+        printf("NO FREE CLUSTERS\n");
+        return;
+    }
+    new_entry.size = 0;
+    new_entry.start_cluster = FAT_FREE;
+    new_entry.is_directory = is_directory;
 
-            // **Пропускаем копирование папки самой в себя**
-            if (strcmp(new_dest, src_path) == 0 || strcmp(new_dest, dest_path) == 0) {
-                printf("Skipping self-copy: %s\n", filesystem[i].filename);
-                continue;
-            }
+    insert_entry(&new_entry);
+    printf("OK\n");
+}
+
+// List files in a directory
+void ls(const char *dirname) {
+    char target_path[MAX_PATH_LENGTH];
+    if (dirname == NULL || strcmp(dirname, "") == 0 || strcmp(dirname, "ls") == 0) {
+        strncpy(target_path, current_path, MAX_PATH_LENGTH);
+    } else {
+        normalize_path(target_path, dirname);
+    }
+
+    // Check if the directory exists
+    int dir;
+    if (!find_directory(target_path, &dir)) {
+        printf("PATH NOT FOUND\n");
+        return;
+    }
+
+    // Print directory contents
+    int child = *first_child_of(dir);
+    if (child == -1) {
+        printf("EMPTY\n");
+    }
+    for (; child != -1; child = entry_at(child)->next_sibling) {
+        printf("%s: %s%s\n", entry_at(child)->is_directory ? "DIR" : "FILE", entry_at(child)->name,
+               entry_at(child)->is_directory ? "/" : "");
+    }
+}
+
+// Function to change current directory
+void cd(const char *dirname) {
+    if (!dirname || strlen(dirname) == 0) {
+        printf("INVALID ARGUMENT\n");
+        return;
+    }
+
+    char new_path[MAX_PATH_LENGTH];
+    normalize_path(new_path, dirname);
 
-            cp(sub_args);
+    // cd /
+    if (strcmp(dirname, "/") == 0) {
+        current_dir = -1;
+        strcpy(current_path, "/");
+        printf("OK - current path: /\n");
+        return;
+    }
+
+    // cd .. | cd ../ - one hop up the tree
+    if (strcmp(dirname, "..") == 0 || strcmp(dirname, "../") == 0) {
+        if (current_dir != -1) {
+            current_dir = entry_at(current_dir)->parent;
         }
+        entry_path(current_dir, current_path);
+        printf("OK - current path: %s\n", current_path);
+        return;
+    }
+
+    // cd ../..
+    if (strncmp(dirname, "../", 3) == 0) {
+        cd("..");
+        cd(dirname + 3);  // Рекурсивно вызываем `cd` для оставшейся части пути
+        return;
     }
+
+    int dir_index;
+    if (!find_directory(new_path, &dir_index)) {
+        printf("PATH NOT FOUND\n");
+        return;
+    }
+
+    current_dir = dir_index;
+    entry_path(dir_index, current_path);
+
+    printf("OK - current path: %s\n", current_path);
 }
 
-// Function to move or rename a file in the pseudo filesystem
-void mv(const char *args) {
+// Function to print current working directory
+void pwd() {
+    printf("%s\n", current_path);
+}
+
+void create_directory(const char *dirname) {
+    char full_path[MAX_PATH_LENGTH];
+    normalize_path(full_path, dirname);
+
+    if (find_file(full_path) != -1) {  // Check if directory already exists
+        printf("DIRECTORY ALREADY EXISTS\n");
+        return;
+    }
+
+    char name[MAX_PATH_LENGTH];
+    FileEntry new_entry = {0};
+    new_entry.parent = resolve_parent(full_path, name);
+    new_entry.name = name;
+    if (new_entry.parent == NO_PARENT) {
+        printf("PATH NOT FOUND\n");
+        return;
+    }
+    if (!table_fits(0, record_size(name))) {
+        printf("NO FREE CLUSTERS\n");
+        return;
+    }
+    new_entry.size = 0;
+    new_entry.start_cluster = FAT_FREE;
+    new_entry.is_directory = 1;
+
+    insert_entry(&new_entry);
+    printf("OK\n");
+}
+
+int remove_directory(const char *dirname) {
+    char full_path[MAX_PATH_LENGTH];
+    normalize_path(full_path, dirname);
+
+    int dir_index = find_file(full_path);
+    if (dir_index == -1 || !entry_at(dir_index)->is_directory) {
+        printf("DIRECTORY NOT FOUND\n");
+        return -1;
+    }
+
+    // Delete the subtree bottom up through the child handles: files as they come, each
+    // directory once it is empty, up to and including dir_index
+    int dir = dir_index;
+    for (;;) {
+        int child = entry_at(dir)->first_child;
+        if (child != -1 && entry_at(child)->is_directory) {
+            dir = child;
+        } else if (child != -1) {
+            free_clusters(entry_at(child));
+            remove_entry(child);
+        } else {
+            int parent = entry_at(dir)->parent;
+            remove_entry(dir);
+            if (dir == dir_index) {
+                break;
+            }
+            dir = parent;
+        }
+    }
+
+    printf("OK - %s removed\n",dirname);
+    return 0;
+}
+
+// Function to copy a file in the pseudo filesystem
+void cp(const char *args) {
     if (!args || strlen(args) == 0) {
         printf("INVALID ARGUMENTS\n");
         return;
     }
 
+    // cp --clone shares the source clusters instead of copying them
+    if (strncmp(args, "--clone ", 8) == 0) {
+        clone_file(args + 8);
+        return;
+    }
+
+    // cp --jobs N sets how many threads copy the data of a directory
+    int threads = 0;
+    if (strncmp(args, "--jobs ", 7) == 0) {
+        int used = 0;
+        if (sscanf(args + 7, "%d %n", &threads, &used) != 1 || threads < 1 || threads > COPY_MAX_THREADS) {
+            printf("Usage: cp [--jobs 1-%d] <source> <destination>\n", COPY_MAX_THREADS);
+            return;
+        }
+        args += 7 + used;
+    }
+
     char source[MAX_PATH_LENGTH], destination[MAX_PATH_LENGTH];
 
-    // source destination
     int parsed = sscanf(args, "%s %s", source, destination);
     if (parsed != 2) {
         printf("INVALID ARGUMENTS\n");
@@ -580,553 +1573,3485 @@ void mv(const char *args) {
     normalize_path(src_path, source);
     normalize_path(dest_path, destination);
 
-    int src_index = find_file(src_path);
-    if (src_index == -1) {
-        printf("FILE NOT FOUND\n");
-        return;
+    int src_index = find_file(src_path);
+    if (src_index == -1) {
+        printf("FILE NOT FOUND\n");
+        return;
+    }
+
+    FileEntry *src_entry = entry_at(src_index);
+
+    // if destination exists
+    int dest_dir;
+    if (find_directory(dest_path, &dest_dir)) {
+        char joined[MAX_PATH_LENGTH];
+        if (snprintf(joined, MAX_PATH_LENGTH, "%s/%s", dest_path, src_entry->name) >= MAX_PATH_LENGTH) {
+            printf("INVALID ARGUMENTS\n");
+            return;
+        }
+        normalize_path(dest_path, joined); // Убираем двойные слэши
+    }
+
+    // if file or dir exists
+    if (find_file(dest_path) != -1) {
+        printf("DESTINATION FILE OR DIRECTORY ALREADY EXISTS\n");
+        return;
+    }
+
+    char dest_name[MAX_PATH_LENGTH];
+    int dest_parent = resolve_parent(dest_path, dest_name);
+    if (dest_parent == NO_PARENT) {
+        printf("PATH NOT FOUND\n");
+        return;
+    }
+
+    if (!src_entry->is_directory) {
+        FileEntry new_file = {0};
+        new_file.name = dest_name;
+        new_file.parent = dest_parent;
+        new_file.size = src_entry->size;
+        new_file.is_directory = 0;
+
+        if (!table_fits((src_entry->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE, record_size(dest_name))) {
+            printf("NO FREE CLUSTERS\n");
+            return;
+        }
+        if (src_entry->size == 0) {
+            new_file.start_cluster = FAT_FREE;
+        } else {
+            new_file.start_cluster = allocate_cluster(&new_file);
+            if (new_file.start_cluster == -1) {
+                printf("NO FREE CLUSTERS\n");
+                return;
+            }
+
+            // Whole clusters are copied inside the image, extent pair by extent pair
+            size_t bytes = (src_entry->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE * CLUSTER_SIZE;
+            copy_chain_data(src_entry->start_cluster, new_file.start_cluster, bytes);
+        }
+
+        insert_entry(&new_file);
+        // printf("Copied file: %s -> %s\n", src_path, dest_path);
+        printf("OK\n");
+        return;
+    }
+
+    // A copy inside the source would keep finding itself among the children it copies
+    for (int dir = dest_parent; dir != -1; dir = entry_at(dir)->parent) {
+        if (dir == src_index) {
+            printf("CANNOT COPY DIRECTORY INTO ITSELF\n");
+            return;
+        }
+    }
+    if (!subtree_path_fits(src_index, dest_parent, dest_name)) {
+        printf("PATH TOO LONG\n");
+        return;
+    }
+
+    printf("Copying directory %s -> %s\n", src_path, dest_path);
+    copy_tree(src_index, dest_parent, dest_name, threads);
+}
+
+// One file of a directory copy, with its destination chain already allocated
+typedef struct {
+    int src_cluster;
+    int dest_cluster;
+    size_t bytes;
+} CopyJob;
+
+// Work-stealing pool for copy_tree. Every worker starts with a contiguous range of the jobs and
+// takes them from its back; a worker whose range is empty steals from the front of another.
+// No jobs are added while the pool runs, so a worker leaves once every range is empty.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t head;  // next job a thief takes
+    size_t tail;  // one past the next job of the owner
+} CopyQueue;
+
+struct {
+    const CopyJob *jobs;
+    CopyQueue queues[COPY_MAX_THREADS];
+    int workers;
+} copy_pool;
+
+int copy_queue_take(CopyQueue *queue, int steal, size_t *job) {
+    pthread_mutex_lock(&queue->lock);
+    int found = queue->head < queue->tail;
+    if (found) {
+        *job = steal ? queue->head++ : --queue->tail;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+void *copy_worker(void *arg) {
+    int self = (int)(intptr_t)arg;
+    size_t job;
+    for (;;) {
+        int found = copy_queue_take(&copy_pool.queues[self], 0, &job);
+        for (int k = 1; !found && k < copy_pool.workers; k++) {
+            found = copy_queue_take(&copy_pool.queues[(self + k) % copy_pool.workers], 1, &job);
+        }
+        if (!found) {
+            return NULL;
+        }
+        const CopyJob *copy = &copy_pool.jobs[job];
+        copy_chain_extents(copy->src_cluster, copy->dest_cluster, copy->bytes);
+    }
+}
+
+// Copy the directory at src_index as dest_name inside dest_parent. The subtree is snapshotted
+// breadth first, then every entry and chain is created here (the entry table is not thread
+// safe), and only the data is copied by threads (0: one per online CPU).
+void copy_tree(int src_index, int dest_parent, const char *dest_name, int threads) {
+    // Snapshot: nodes[i] is a source entry, parents[i] the position of its directory in nodes
+    size_t count = 0, capacity = 64, need = 0;
+    int *nodes = malloc(capacity * sizeof(int));
+    int *parents = malloc(capacity * sizeof(int));
+    if (!nodes || !parents) {
+        printf("ERROR: Cannot allocate copy list\n");
+        free(nodes);
+        free(parents);
+        return;
+    }
+    nodes[count] = src_index;
+    parents[count++] = -1;
+    for (size_t i = 0; i < count; i++) {
+        const FileEntry *entry = entry_at(nodes[i]);
+        if (!entry->is_directory) {
+            need += (entry->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+            continue;
+        }
+        for (int child = entry->first_child; child != -1; child = entry_at(child)->next_sibling) {
+            if (count == capacity) {
+                capacity *= 2;
+                int *grown_nodes = realloc(nodes, capacity * sizeof(int));
+                int *grown_parents = grown_nodes ? realloc(parents, capacity * sizeof(int)) : NULL;
+                if (grown_nodes) nodes = grown_nodes;
+                if (grown_parents) parents = grown_parents;
+                if (!grown_nodes || !grown_parents) {
+                    printf("ERROR: Cannot allocate copy list\n");
+                    free(nodes);
+                    free(parents);
+                    return;
+                }
+            }
+            nodes[count] = child;
+            parents[count++] = (int)i;
+        }
+    }
+    size_t records = record_size(dest_name);
+    for (size_t i = 1; i < count; i++) {
+        records += record_size(entry_at(nodes[i])->name);
+    }
+    if (!table_fits(need, records)) {
+        printf("NO FREE CLUSTERS\n");
+        free(nodes);
+        free(parents);
+        return;
+    }
+
+    // Preallocate: parents come before their children, so each one's copy exists already.
+    // nodes[] is reused for the destination entries once a position has been handled.
+    CopyJob *jobs = malloc(count * sizeof(CopyJob));
+    if (!jobs) {
+        printf("ERROR: Cannot allocate copy list\n");
+        free(nodes);
+        free(parents);
+        return;
+    }
+    size_t job_count = 0, directories = 0;
+    for (size_t i = 0; i < count; i++) {
+        const FileEntry *src = entry_at(nodes[i]);
+        FileEntry copy = {0};
+        copy.name = i == 0 ? dest_name : src->name;
+        copy.parent = i == 0 ? dest_parent : nodes[parents[i]];
+        copy.is_directory = src->is_directory;
+        copy.size = src->is_directory ? 0 : src->size;
+        copy.start_cluster = FAT_FREE;
+        copy.end_cluster = FAT_FREE;
+        if (copy.size > 0) {
+            extend_chain(&copy, (copy.size + CLUSTER_SIZE - 1) / CLUSTER_SIZE);  // fits, checked above
+            jobs[job_count].src_cluster = (int)src->start_cluster;
+            jobs[job_count].dest_cluster = (int)copy.start_cluster;
+            jobs[job_count].bytes = (copy.size + CLUSTER_SIZE - 1) / CLUSTER_SIZE * CLUSTER_SIZE;
+            job_count++;
+        }
+        directories += copy.is_directory ? 1 : 0;
+        nodes[i] = insert_entry(&copy);
+    }
+    free(nodes);
+    free(parents);
+
+    // The workers bypass the cache: sources must be on disk and no copy may linger in it
+    cache_flush();
+    for (size_t i = 0; i < job_count; i++) {
+        int cluster = jobs[i].dest_cluster;
+        Extent extent;
+        for (size_t left = jobs[i].bytes; left > 0 && next_extent(&cluster, MAX_EXTENT_CLUSTERS, &extent);) {
+            cache_forget(extent.start, extent.count);
+            left -= extent.count * CLUSTER_SIZE < left ? extent.count * CLUSTER_SIZE : left;
+        }
+    }
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : cpus > COPY_MAX_THREADS ? COPY_MAX_THREADS : (int)cpus;
+    }
+    if ((size_t)threads > job_count) {
+        threads = job_count > 0 ? (int)job_count : 1;
+    }
+
+    copy_pool.jobs = jobs;
+    copy_pool.workers = threads;
+    for (int t = 0; t < threads; t++) {
+        pthread_mutex_init(&copy_pool.queues[t].lock, NULL);
+        copy_pool.queues[t].head = job_count * (size_t)t / (size_t)threads;
+        copy_pool.queues[t].tail = job_count * (size_t)(t + 1) / (size_t)threads;
+    }
+
+    // The calling thread is worker 0
+    pthread_t workers[COPY_MAX_THREADS];
+    int started = 1;
+    for (; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, copy_worker, (void *)(intptr_t)started) != 0) {
+            break;  // the ranges of workers that did not start are stolen by the others
+        }
+    }
+    copy_worker((void *)(intptr_t)0);
+    for (int t = 1; t < started; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_mutex_destroy(&copy_pool.queues[t].lock);
+    }
+    free(jobs);
+
+    printf("OK - %zu files, %zu directories copied with %d thread(s)\n", count - directories, directories, threads);
+}
+
+// Function to move or rename a file in the pseudo filesystem
+void mv(const char *args) {
+    if (!args || strlen(args) == 0) {
+        printf("INVALID ARGUMENTS\n");
+        return;
+    }
+
+    char source[MAX_PATH_LENGTH], destination[MAX_PATH_LENGTH];
+
+    // source destination
+    int parsed = sscanf(args, "%s %s", source, destination);
+    if (parsed != 2) {
+        printf("INVALID ARGUMENTS\n");
+        return;
+    }
+
+    char src_path[MAX_PATH_LENGTH], dest_path[MAX_PATH_LENGTH];
+    normalize_path(src_path, source);
+    normalize_path(dest_path, destination);
+
+    int src_index = find_file(src_path);
+    if (src_index == -1) {
+        printf("FILE NOT FOUND\n");
+        return;
+    }
+
+    // is destination a dir
+    int dest_dir;
+    if (find_directory(dest_path, &dest_dir)) {
+        char joined[MAX_PATH_LENGTH];
+        if (snprintf(joined, MAX_PATH_LENGTH, "%s/%s", dest_path, entry_at(src_index)->name) >= MAX_PATH_LENGTH) {
+            printf("INVALID ARGUMENTS\n");
+            return;
+        }
+        normalize_path(dest_path, joined);
+    }
+
+    // Проверяем, существует ли уже файл/папка с таким именем
+    if (find_file(dest_path) != -1) {
+        printf("PATH ALREADY EXISTS\n");
+        return;
+    }
+
+    char dest_name[MAX_PATH_LENGTH];
+    int dest_parent = resolve_parent(dest_path, dest_name);
+    if (dest_parent == NO_PARENT) {
+        printf("PATH NOT FOUND\n");
+        return;
+    }
+
+    // A directory cannot become its own descendant
+    for (int dir = dest_parent; dir != -1; dir = entry_at(dir)->parent) {
+        if (dir == src_index) {
+            printf("CANNOT MOVE DIRECTORY INTO ITSELF\n");
+            return;
+        }
+    }
+    if (!subtree_path_fits(src_index, dest_parent, dest_name)) {
+        printf("PATH TOO LONG\n");
+        return;
+    }
+
+    size_t old_length = strlen(entry_at(src_index)->name);
+    if (strlen(dest_name) > old_length && !table_fits(0, strlen(dest_name) - old_length)) {
+        printf("NO FREE CLUSTERS\n");
+        return;
+    }
+
+    // Only this entry changes; everything below it follows through the tree
+    rename_entry(src_index, dest_parent, dest_name);
+    printf("OK\n");
+}
+
+// Copy-on-write clone: the new entry points at the source chain and only the first cluster
+// gains a reference, so cloning costs the same for any file size
+void clone_file(const char *args) {
+    if (!args || strlen(args) == 0) {
+        printf("INVALID ARGUMENTS\n");
+        return;
+    }
+
+    char source[MAX_PATH_LENGTH], destination[MAX_PATH_LENGTH];
+    if (sscanf(args, "%s %s", source, destination) != 2) {
+        printf("INVALID ARGUMENTS\n");
+        return;
+    }
+
+    char src_path[MAX_PATH_LENGTH], dest_path[MAX_PATH_LENGTH];
+    normalize_path(src_path, source);
+    normalize_path(dest_path, destination);
+
+    int src_index = find_file(src_path);
+    if (src_index == -1) {
+        printf("FILE NOT FOUND\n");
+        return;
+    }
+    if (entry_at(src_index)->is_directory) {
+        printf("CANNOT CLONE DIRECTORY: %s\n", src_path);
+        return;
+    }
+
+    int dest_dir;
+    if (find_directory(dest_path, &dest_dir)) {
+        char joined[MAX_PATH_LENGTH];
+        if (snprintf(joined, MAX_PATH_LENGTH, "%s/%s", dest_path, entry_at(src_index)->name) >= MAX_PATH_LENGTH) {
+            printf("INVALID ARGUMENTS\n");
+            return;
+        }
+        normalize_path(dest_path, joined);
+    }
+
+    if (find_file(dest_path) != -1) {
+        printf("DESTINATION FILE OR DIRECTORY ALREADY EXISTS\n");
+        return;
+    }
+
+    char name[MAX_PATH_LENGTH];
+    FileEntry new_file = *entry_at(src_index);
+    new_file.parent = resolve_parent(dest_path, name);
+    new_file.name = name;
+    if (new_file.parent == NO_PARENT) {
+        printf("PATH NOT FOUND\n");
+        return;
+    }
+    if (!table_fits(0, record_size(name))) {
+        printf("NO FREE CLUSTERS\n");
+        return;
+    }
+    if (new_file.start_cluster != FAT_FREE) {
+        cluster_refs[new_file.start_cluster]++;
+        if (entry_at(src_index)->extents) {
+            entry_at(src_index)->extents->shared_from = 0;  // the whole chain is shared now
+        }
+    }
+
+    insert_entry(&new_file);
+    printf("OK\n");
+}
+
+// Take one free cluster as a single-cluster chain, or -1 when the disk is full
+int claim_cluster() {
+    Extent run;
+    if (!take_free_run(1, -1, &run)) {
+        return -1;
+    }
+
+    fat[run.start] = FAT_END;
+    cluster_refs[run.start] = 1;
+    return run.start;
+}
+
+// Make the cluster at a position of the file's chain private before it is written. Clusters are
+// shared from the first one with more than one reference to the end of the chain, so that part
+// up to the position is copied; the copy links back into the old chain after it.
+// Returns the physical cluster to write, or -1 when there is no space for the copies.
+int unshare_cluster(FileEntry *file, size_t position) {
+    extent_map_drop(file);
+    int prev = -1;
+    int current = file->start_cluster;
+    size_t index = 0;
+
+    while (current >= 0 && index < position && cluster_refs[current] <= 1) {
+        prev = current;
+        current = fat[current];
+        index++;
+    }
+    if (current < 0) {
+        return -1;
+    }
+    if (cluster_refs[current] <= 1) {
+        return current;  // nothing on the way is shared
+    }
+
+    // current is the first shared cluster; copy it and everything up to the position
+    char buffer[CLUSTER_SIZE];
+    int old = current;
+    int first = 1;
+    for (;;) {
+        int copy = claim_cluster();
+        if (copy == -1) {
+            if (!first) {
+                fat[prev] = old;  // rejoin the shared chain where the copying stopped
+                cluster_refs[old]++;
+            }
+            return -1;
+        }
+
+        read_cluster_data(old, buffer, CLUSTER_SIZE);
+        write_cluster_data(copy, buffer, CLUSTER_SIZE);
+
+        if (prev == -1) {
+            file->start_cluster = copy;
+        } else {
+            fat[prev] = copy;
+        }
+        if (first) {
+            cluster_refs[old]--;  // this file no longer reaches the shared part through prev
+            first = 0;
+        }
+
+        int next = fat[old];
+        if (index == position || next < 0) {
+            fat[copy] = next;  // rejoin the shared tail
+            if (next >= 0) {
+                cluster_refs[next]++;
+            }
+            if ((int)file->end_cluster == old) {
+                file->end_cluster = copy;
+            }
+            return copy;
+        }
+
+        // The copy will point at the next copy, so the old successor stays with the other owners
+        prev = copy;
+        old = next;
+        index++;
+    }
+}
+
+// Drop one reference to the chain starting at cluster. A cluster is freed only when nothing else
+// refers to it; the first cluster still referenced elsewhere keeps the rest of the chain alive.
+void release_chain(int cluster) {
+    // Consecutive clusters are handed back to the free-extent index as one run
+    int run_start = -1;
+    size_t run_count = 0;
+    int current = cluster;
+    while (current >= 0 && current < max_clusters) {
+        if (--cluster_refs[current] > 0) {
+            break; // still shared with another file
+        }
+        int next = fat[current];
+        fat[current] = FAT_FREE; // free cluster
+
+        if (run_count > 0 && current == run_start + (int)run_count) {
+            run_count++;
+        } else {
+            if (run_count > 0) {
+                release_run(run_start, run_count);
+            }
+            run_start = current;
+            run_count = 1;
+        }
+        current = next;
+    }
+    if (run_count > 0) {
+        release_run(run_start, run_count);
+    }
+}
+
+// Drop the file's reference to its chain
+void free_clusters(FileEntry *file) {
+    extent_map_drop(file);
+    if (file->start_cluster == FAT_FREE) {
+        return; // no allocated clusters
+    }
+
+    release_chain((int)file->start_cluster);
+    file->start_cluster = FAT_FREE;
+    file->end_cluster = FAT_FREE;
+}
+
+void extent_map_drop(FileEntry *file) {
+    free(file->extents);
+    file->extents = NULL;
+}
+
+// The file's extent map, built from its chain on first use. Returns NULL when it cannot be allocated.
+ExtentMap *extent_map_get(FileEntry *file) {
+    if (file->extents) {
+        return file->extents;
+    }
+
+    // One pass to size the map, one to fill it; a broken chain ends the map where it breaks
+    size_t runs = 0;
+    size_t clusters = 0;
+    int prev = -1;
+    for (int c = file->start_cluster; c >= 0 && c < max_clusters && clusters < max_clusters; c = fat[c]) {
+        if (c != prev + 1 || prev == -1) {
+            runs++;
+        }
+        prev = c;
+        clusters++;
+    }
+
+    ExtentMap *map = malloc(sizeof(ExtentMap) + runs * sizeof(MappedRun));
+    if (!map) {
+        return NULL;
+    }
+    map->cluster_count = clusters;
+    map->shared_from = clusters;
+    map->run_count = 0;
+    map->run_capacity = runs;
+    size_t logical = 0;
+    prev = -1;
+    for (int c = file->start_cluster; logical < clusters; prev = c, c = fat[c], logical++) {
+        if (c != prev + 1 || prev == -1) {
+            map->runs[map->run_count].logical = logical;
+            map->runs[map->run_count].start = c;
+            map->runs[map->run_count].count = 0;
+            map->run_count++;
+        }
+        map->runs[map->run_count - 1].count++;
+        if (cluster_refs[c] > 1 && map->shared_from == clusters) {
+            map->shared_from = logical;
+        }
+    }
+
+    file->extents = map;
+    return map;
+}
+
+// Physical cluster holding the given logical cluster (binary search over the runs), or -1 past the end
+int extent_map_lookup(const ExtentMap *map, size_t logical) {
+    if (logical >= map->cluster_count) {
+        return -1;
+    }
+    size_t low = 0;
+    size_t high = map->run_count - 1;
+    while (low < high) {
+        size_t mid = (low + high + 1) / 2;
+        if (map->runs[mid].logical <= logical) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return map->runs[low].start + (int)(logical - map->runs[low].logical);
+}
+
+// Record clusters just linked after the end of the file's chain, so appending keeps the map
+void extent_map_append(FileEntry *file, int start, size_t count) {
+    ExtentMap *map = file->extents;
+    if (!map) {
+        return;
+    }
+    if (map->run_count > 0) {
+        MappedRun *last = &map->runs[map->run_count - 1];
+        if (last->start + (int)last->count == start) {
+            last->count += count;
+            map->shared_from += map->shared_from == map->cluster_count ? count : 0;
+            map->cluster_count += count;
+            return;
+        }
+    }
+    if (map->run_count == map->run_capacity) {
+        size_t capacity = map->run_capacity ? map->run_capacity * 2 : 4;
+        ExtentMap *grown = realloc(map, sizeof(ExtentMap) + capacity * sizeof(MappedRun));
+        if (!grown) {
+            extent_map_drop(file);  // rebuilt from the chain when next needed
+            return;
+        }
+        map = file->extents = grown;
+        map->run_capacity = capacity;
+    }
+    map->runs[map->run_count].logical = map->cluster_count;
+    map->runs[map->run_count].start = start;
+    map->runs[map->run_count].count = count;
+    map->run_count++;
+    map->shared_from += map->shared_from == map->cluster_count ? count : 0;
+    map->cluster_count += count;
+}
+
+// Forget everything past the first clusters of the file after its chain has been cut there
+void extent_map_trim(FileEntry *file, size_t clusters) {
+    ExtentMap *map = file->extents;
+    if (!map || clusters >= map->cluster_count) {
+        return;
+    }
+    if (clusters == 0) {
+        extent_map_drop(file);
+        return;
+    }
+    size_t low = 0;
+    size_t high = map->run_count - 1;
+    while (low < high) {
+        size_t mid = (low + high + 1) / 2;
+        if (map->runs[mid].logical < clusters) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    map->runs[low].count = clusters - map->runs[low].logical;
+    map->run_count = low + 1;
+    map->cluster_count = clusters;
+    if (map->shared_from > clusters) {
+        map->shared_from = clusters;
+    }
+}
+
+void rm(const char *filename) {
+    char full_path[MAX_PATH_LENGTH];
+    normalize_path(full_path, filename);
+
+    int index = find_file(full_path);
+    if (index == -1) {
+        printf("FILE NOT FOUND\n");
+        return;
+    }
+
+    FileEntry *file = entry_at(index);
+    if (file->is_directory) {
+        printf("CANNOT REMOVE DIRECTORY WITH rm: %s\n", full_path);
+        return;
+    }
+
+    free_clusters(file);
+    remove_entry(index);
+
+    printf("OK\n");
+}
+
+// Function to display file content
+void cat(const char *filename) {
+    char full_path[MAX_PATH_LENGTH];
+    normalize_path(full_path, filename);
+
+    int file_index = find_file(full_path);
+    if (file_index == -1 || entry_at(file_index)->is_directory) {
+        printf("FILE NOT FOUND\n");
+        return;
+    }
+
+    FileEntry *file = entry_at(file_index);
+
+    if (file->size == 0) {
+        printf("FILE EMPTY\n");
+        return;
+    }
+
+    // Small files go through the cache, so printing the same file again costs no disk reads;
+    // larger ones are streamed by the kernel
+    if (cache_capacity && file->size <= CAT_CACHED_CLUSTERS * CLUSTER_SIZE) {
+        char buffer[CAT_CACHED_CLUSTERS * CLUSTER_SIZE];
+        int cluster = (int)file->start_cluster;
+        read_chain_data(&cluster, buffer, file->size);
+        fwrite(buffer, 1, file->size, stdout);
+        printf("\n");
+        return;
+    }
+
+    // Whatever printf buffered must reach stdout before the kernel writes the file after it
+    fflush(stdout);
+    send_chain_data(file->start_cluster, file->size, STDOUT_FILENO);
+
+    printf("\n");
+}
+
+void info(const char *name) {
+    if (!name || strlen(name) == 0) {
+        printf("INVALID ARGUMENTS\n");
+        return;
+    }
+
+    char full_path[MAX_PATH_LENGTH];
+    normalize_path(full_path, name);  // Convert relative path to absolute path
+
+    int index = find_file(full_path);
+    if (index == -1) {
+        printf("FILE NOT FOUND\n");
+        return;
+    }
+
+    FileEntry *file = entry_at(index);
+    char path[MAX_PATH_LENGTH];
+    entry_path(index, path);
+
+    // If the entry is a directory, no clusters are allocated
+    if (file->is_directory) {
+        printf("%s: Is a directory, no clusters allocated\n", path);
+        return;
+    }
+
+    // If the file has no allocated clusters
+    if (file->start_cluster == FAT_FREE) {
+        printf("%s: No clusters allocated\n", path);
+        return;
+    }
+
+    printf("%s: Clusters ", path);
+
+    int current = file->start_cluster;
+    while (current != FAT_END) {
+        // Check for corrupted clusters (out of valid range)
+        if (current < 0 || current >= max_clusters) {
+            printf(" -> [CORRUPTED: %d]", current);
+            break;
+        }
+
+        printf("%d", current);
+
+        // Move to the next cluster
+        current = fat[current];
+
+        if (current != FAT_END) {
+            printf(" -> ");
+        }
+    }
+    printf("\n");
+    printf("%s: %zu extent(s)\n", path, count_extents(file->start_cluster));
+}
+
+void incp(const char *args) {
+    if (!args || strlen(args) == 0) {
+        printf("INVALID ARGUMENTS\n");
+        return;
+    }
+
+    char source[MAX_PATH_LENGTH], destination[MAX_PATH_LENGTH];
+    size_t limit = SIZE_MAX;
+
+    // Parse input arguments; a byte count is only taken with "-"
+    int parsed = sscanf(args, "%255s %255s %zu", source, destination, &limit);
+    if (parsed < 2 || (parsed == 3 && strcmp(source, "-") != 0)) {
+        printf("INVALID ARGUMENTS\n");
+        return;
+    }
+
+    // "-" reads the data from stdin, which also carries the commands: without a byte count it
+    // reads to EOF, so it has to be the last command of a piped script
+    FILE *src = strcmp(source, "-") == 0 ? stdin : fopen(source, "rb");
+    if (!src) {
+        printf("FILE NOT FOUND\n");
+        return;
+    }
+
+    char full_path[MAX_PATH_LENGTH];
+    normalize_path(full_path, destination);
+
+    // Check if the file already exists in the filesystem
+    if (find_file(full_path) != -1) {
+        printf("EXIST\n");
+        if (src != stdin) fclose(src);
+        return;
+    }
+
+    char name[MAX_PATH_LENGTH];
+    if (resolve_parent(full_path, name) == NO_PARENT) {
+        printf("PATH NOT FOUND\n");
+        if (src != stdin) fclose(src);
+        return;
+    }
+
+    // Pipes, FIFOs and stdin have no size up front - append clusters as the data arrives
+    struct stat st;
+    if (src == stdin || fstat(fileno(src), &st) != 0 || !S_ISREG(st.st_mode)) {
+        incp_stream(src, full_path, limit);
+        if (src == stdin) {
+            clearerr(stdin);
+        } else {
+            fclose(src);
+        }
+        return;
+    }
+
+    // Determine the file size
+    fseek(src, 0, SEEK_END);
+    size_t file_size = ftell(src);
+    rewind(src);
+
+    size_t needed_clusters = (file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    int free_clusters = count_free_clusters();
+
+    printf("need:%zu / free:%zu\n", needed_clusters, free_clusters);
+
+    // Check if there are enough free clusters, the directory table's included
+    if (!table_fits(needed_clusters, record_size(name))) {
+        printf("NO FREE CLUSTERS\n");
+        fclose(src);
+        return;
+    }
+
+    // Create a new file entry in the pseudo-FAT
+    FileEntry new_file = {0};
+    new_file.parent = resolve_parent(full_path, name);
+    new_file.name = name;
+    new_file.size = file_size;
+    new_file.start_cluster = allocate_cluster(&new_file);
+    new_file.is_directory = 0;
+
+    insert_entry(&new_file);
+
+    // Write data to FAT-based system (simulated disk)
+    int cluster_index = new_file.start_cluster;
+    size_t bytes_left = file_size;
+    char *buffer = malloc(MAX_EXTENT_CLUSTERS * CLUSTER_SIZE);
+    if (!buffer) {
+        printf("ERROR: Cannot allocate write buffer\n");
+        fclose(src);
+        return;
+    }
+
+    while (bytes_left > 0 && cluster_index >= 0) {
+        size_t to_read = (bytes_left > MAX_EXTENT_CLUSTERS * CLUSTER_SIZE) ? MAX_EXTENT_CLUSTERS * CLUSTER_SIZE : bytes_left;
+        size_t got = fread(buffer, 1, to_read, src);
+        memset(buffer + got, 0, to_read - got);
+
+        // Write buffer to simulated disk, one transfer per contiguous run
+        write_chain_data(&cluster_index, buffer, to_read);
+
+        bytes_left -= to_read;
+    }
+    free(buffer);
+
+    fclose(src);
+    printf("OK\n");
+}
+
+// fread that takes at most *left bytes in total, so a "-" source with a byte count stops after
+// its data and leaves the rest of stdin to the command loop
+size_t read_limited(FILE *src, char *buffer, size_t size, size_t *left) {
+    size_t got = fread(buffer, 1, size < *left ? size : *left, src);
+    *left -= got;
+    return got;
+}
+
+// Ingest a stream of unknown length (at most limit bytes): each batch read from src gets its
+// clusters appended at end_cluster. If the disk fills up, everything taken so far is released.
+void incp_stream(FILE *src, const char *full_path, size_t limit) {
+    char name[MAX_PATH_LENGTH];
+    FileEntry new_file = {0};
+    new_file.parent = resolve_parent(full_path, name);  // incp has checked that it exists
+    new_file.name = name;
+    new_file.size = 0;
+    new_file.start_cluster = FAT_FREE;
+    new_file.end_cluster = FAT_FREE;
+    new_file.is_directory = 0;
+
+    char *buffer = malloc(STREAM_BATCH_CLUSTERS * CLUSTER_SIZE);
+    if (!buffer) {
+        printf("ERROR: Cannot allocate write buffer\n");
+        return;
+    }
+
+    size_t got;
+    while ((got = read_limited(src, buffer, STREAM_BATCH_CLUSTERS * CLUSTER_SIZE, &limit)) > 0) {
+        size_t clusters = (got + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+        int first = table_fits(clusters, record_size(name)) ? extend_chain(&new_file, clusters) : -1;
+        if (first == -1) {
+            free_clusters(&new_file);
+            free(buffer);
+            printf("NO FREE CLUSTERS\n");
+            return;
+        }
+
+        write_chain_data(&first, buffer, got);
+        new_file.size += got;
+    }
+    free(buffer);
+
+    if (ferror(src)) {
+        free_clusters(&new_file);
+        printf("CANNOT READ SOURCE\n");
+        return;
+    }
+
+    insert_entry(&new_file);
+    printf("OK - %zu bytes\n", new_file.size);
+}
+
+void outcp(const char *args) {
+    if (!args || strlen(args) == 0) {
+        printf("INVALID ARGUMENTS\n");
+        return;
+    }
+
+    char source[MAX_PATH_LENGTH], destination[MAX_PATH_LENGTH];
+
+    // Parse input arguments
+    int parsed = sscanf(args, "%s %s", source, destination);
+    if (parsed != 2) {
+        printf("INVALID ARGUMENTS\n");
+        return;
+    }
+
+    char full_path[MAX_PATH_LENGTH];
+    normalize_path(full_path, source);
+
+    // Locate the file in the pseudo-FAT
+    int file_index = find_file(full_path);
+    if (file_index == -1) {
+        printf("FILE NOT FOUND\n");
+        return;
+    }
+
+    FileEntry *file = entry_at(file_index);
+
+    int dest = open(destination, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dest < 0) {
+        printf("PATH NOT FOUND\n");
+        return;
+    }
+
+    // Extents go straight from the image to the host file
+    send_chain_data(file->start_cluster, file->size, dest);
+
+    close(dest);
+    printf("OK\n");
+}
+
+// read <file> <offset> <len> - print part of a file. The extent map gives the cluster holding
+// the offset directly, so the cost does not depend on how far into the file it is.
+void read_cmd(const char *args) {
+    char path[MAX_PATH_LENGTH];
+    size_t offset, length;
+    if (!args || sscanf(args, "%255s %zu %zu", path, &offset, &length) != 3) {
+        printf("Usage: read <file> <offset> <len>\n");
+        return;
+    }
+
+    char full_path[MAX_PATH_LENGTH];
+    normalize_path(full_path, path);
+    int index = find_file(full_path);
+    if (index == -1 || entry_at(index)->is_directory) {
+        printf("FILE NOT FOUND\n");
+        return;
+    }
+
+    FileEntry *file = entry_at(index);
+    if (offset >= file->size) {
+        printf("OFFSET BEYOND END OF FILE\n");
+        return;
+    }
+    if (length > file->size - offset) {
+        length = file->size - offset;
+    }
+
+    ExtentMap *map = extent_map_get(file);
+    char *buffer = malloc(MAX_EXTENT_CLUSTERS * CLUSTER_SIZE);
+    if (!map || !buffer) {
+        printf("ERROR: Cannot allocate read buffer\n");
+        free(buffer);
+        return;
+    }
+
+    // Whole clusters are read a window at a time; only the requested bytes are printed
+    size_t position = offset;
+    size_t end = offset + length;
+    while (position < end) {
+        size_t logical = position / CLUSTER_SIZE;
+        size_t window_start = logical * CLUSTER_SIZE;
+        size_t window_end = window_start + MAX_EXTENT_CLUSTERS * CLUSTER_SIZE < end ?
+                            window_start + MAX_EXTENT_CLUSTERS * CLUSTER_SIZE : end;
+        int cluster = extent_map_lookup(map, logical);
+        if (cluster == -1) {
+            break;  // the chain is shorter than the size says
+        }
+        read_chain_data(&cluster, buffer, window_end - window_start);
+        fwrite(buffer + (position - window_start), 1, window_end - position, stdout);
+        position = window_end;
+    }
+    free(buffer);
+    printf("\n");
+}
+
+// write <file> <offset> <data|hostfile> - overwrite part of a file, growing it when the write
+// ends past its size (a gap before the offset reads back as zeros). When the argument names
+// a host file its contents are written, otherwise the text itself.
+void write_cmd(const char *args) {
+    char path[MAX_PATH_LENGTH];
+    size_t offset;
+    int consumed = 0;
+    if (!args || sscanf(args, "%255s %zu %n", path, &offset, &consumed) != 2 || args[consumed] == '\0') {
+        printf("Usage: write <file> <offset> <data|hostfile>\n");
+        return;
+    }
+    const char *data = args + consumed;
+
+    char full_path[MAX_PATH_LENGTH];
+    normalize_path(full_path, path);
+    int index = find_file(full_path);
+    if (index == -1 || entry_at(index)->is_directory) {
+        printf("FILE NOT FOUND\n");
+        return;
+    }
+    FileEntry *file = entry_at(index);
+
+    FILE *src = fopen(data, "rb");
+    struct stat st;
+    size_t length = strlen(data);
+    if (src && fstat(fileno(src), &st) == 0 && S_ISREG(st.st_mode)) {
+        length = (size_t)st.st_size;
+    } else if (src) {
+        fclose(src);
+        src = NULL;
+    }
+    if (length == 0) {
+        printf("OK\n");
+        if (src) fclose(src);
+        return;
+    }
+
+    size_t end = offset + length;
+    size_t start = offset < file->size ? offset : file->size;  // zero-fill from the old end
+    size_t have = (file->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    size_t need = (end + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+
+    ExtentMap *map = extent_map_get(file);
+    char *buffer = malloc(MAX_EXTENT_CLUSTERS * CLUSTER_SIZE);
+    if (!map || !buffer) {
+        printf("ERROR: Cannot allocate write buffer\n");
+        free(buffer);
+        if (src) fclose(src);
+        return;
+    }
+
+    // Clusters shared with a clone are copied before they are written. A shared tail is copied
+    // before growing too, or the new clusters would be linked into the other file as well.
+    size_t last = (end - 1) / CLUSTER_SIZE;
+    if (need > have && have > 0) {
+        last = have - 1;
+    }
+    if (map->shared_from <= last && last < map->cluster_count && unshare_cluster(file, last) == -1) {
+        printf("NO FREE CLUSTERS\n");
+        free(buffer);
+        if (src) fclose(src);
+        return;
+    }
+    if (need > have && extend_chain(file, need - have) == -1) {
+        printf("NO FREE CLUSTERS\n");
+        free(buffer);
+        if (src) fclose(src);
+        return;
+    }
+    if (end > file->size) {
+        file->size = end;
+    }
+    map = extent_map_get(file);
+    if (!map) {
+        printf("ERROR: Cannot allocate write buffer\n");
+        free(buffer);
+        if (src) fclose(src);
+        return;
+    }
+
+    size_t position = start;
+    while (position < end) {
+        size_t logical = position / CLUSTER_SIZE;
+        size_t window_start = logical * CLUSTER_SIZE;
+        size_t window_end = window_start + MAX_EXTENT_CLUSTERS * CLUSTER_SIZE < end ?
+                            window_start + MAX_EXTENT_CLUSTERS * CLUSTER_SIZE : end;
+        size_t span = (window_end - window_start + CLUSTER_SIZE - 1) / CLUSTER_SIZE * CLUSTER_SIZE;
+        int cluster = extent_map_lookup(map, logical);
+        if (cluster == -1) {
+            break;
+        }
+
+        // Clusters cut by either end of the write keep the bytes around it
+        if (position != window_start || window_end != window_start + span) {
+            int first = cluster;
+            read_chain_data(&first, buffer, span);
+        }
+        for (size_t at = position; at < window_end;) {
+            char *target = buffer + (at - window_start);
+            if (at < offset) {
+                size_t gap = (offset < window_end ? offset : window_end) - at;
+                memset(target, 0, gap);
+                at += gap;
+            } else if (src) {
+                size_t got = fread(target, 1, window_end - at, src);
+                memset(target + got, 0, window_end - at - got);
+                at = window_end;
+            } else {
+                memcpy(target, data + (at - offset), window_end - at);
+                at = window_end;
+            }
+        }
+        write_chain_data(&cluster, buffer, span);
+        position = window_end;
+    }
+
+    free(buffer);
+    if (src) fclose(src);
+    printf("OK\n");
+}
+
+// Copy the clusters of the file's tail that a clone also reaches, so that the end of the chain
+// can be relinked without touching the other file. Returns -1 when there is no space for them.
+int unshare_tail(FileEntry *file) {
+    ExtentMap *map = extent_map_get(file);
+    if (!map) {
+        return -1;
+    }
+    if (map->shared_from >= map->cluster_count) {
+        return 0;
+    }
+    return unshare_cluster(file, map->cluster_count - 1) == -1 ? -1 : 0;
+}
+
+// append <file> <hostfile|-> [bytes] - add data at the end of a file. The free part of the last
+// cluster is filled in place through end_cluster and new clusters are linked after it, so the
+// cost depends only on the amount appended. "-" reads stdin to EOF unless given a byte count.
+void append_cmd(const char *args) {
+    char path[MAX_PATH_LENGTH], source[MAX_PATH_LENGTH];
+    size_t limit = SIZE_MAX;
+    int parsed = args ? sscanf(args, "%255s %255s %zu", path, source, &limit) : 0;
+    if (parsed < 2 || (parsed == 3 && strcmp(source, "-") != 0)) {
+        printf("Usage: append <file> <hostfile|-> [bytes]\n");
+        return;
+    }
+
+    char full_path[MAX_PATH_LENGTH];
+    normalize_path(full_path, path);
+    int index = find_file(full_path);
+    if (index == -1 || entry_at(index)->is_directory) {
+        printf("FILE NOT FOUND\n");
+        return;
+    }
+    FileEntry *file = entry_at(index);
+
+    FILE *src = strcmp(source, "-") == 0 ? stdin : fopen(source, "rb");
+    if (!src) {
+        printf("FILE NOT FOUND\n");
+        return;
+    }
+
+    char *buffer = malloc(STREAM_BATCH_CLUSTERS * CLUSTER_SIZE);
+    if (!buffer || unshare_tail(file) == -1) {
+        printf(buffer ? "NO FREE CLUSTERS\n" : "ERROR: Cannot allocate write buffer\n");
+        free(buffer);
+        if (src != stdin) fclose(src);
+        return;
+    }
+
+    size_t appended = 0;
+    size_t used = file->size % CLUSTER_SIZE;
+    if (used != 0 && file->end_cluster != FAT_FREE) {
+        read_cluster_data((int)file->end_cluster, buffer, CLUSTER_SIZE);
+        size_t got = read_limited(src, buffer + used, CLUSTER_SIZE - used, &limit);
+        if (got > 0) {
+            write_cluster_data((int)file->end_cluster, buffer, used + got);
+            file->size += got;
+            appended += got;
+        }
+    }
+
+    int full = 0;
+    size_t got;
+    while ((got = read_limited(src, buffer, STREAM_BATCH_CLUSTERS * CLUSTER_SIZE, &limit)) > 0) {
+        int first = extend_chain(file, (got + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+        if (first == -1) {
+            full = 1;  // what was appended so far stays
+            break;
+        }
+        write_chain_data(&first, buffer, got);
+        file->size += got;
+        appended += got;
+    }
+    free(buffer);
+
+    int failed = ferror(src);
+    if (src == stdin) {
+        clearerr(stdin);
+    } else {
+        fclose(src);
+    }
+    if (full) {
+        printf("NO FREE CLUSTERS - %zu bytes appended\n", appended);
+    } else if (failed) {
+        printf("CANNOT READ SOURCE - %zu bytes appended\n", appended);
+    } else {
+        printf("OK - %zu bytes appended\n", appended);
+    }
+}
+
+// truncate <file> <size> - cut a file down, freeing only the clusters past the new end, or grow it
+// with zeros
+void truncate_cmd(const char *args) {
+    char path[MAX_PATH_LENGTH];
+    size_t size;
+    if (!args || sscanf(args, "%255s %zu", path, &size) != 2) {
+        printf("Usage: truncate <file> <size>\n");
+        return;
+    }
+
+    char full_path[MAX_PATH_LENGTH];
+    normalize_path(full_path, path);
+    int index = find_file(full_path);
+    if (index == -1 || entry_at(index)->is_directory) {
+        printf("FILE NOT FOUND\n");
+        return;
+    }
+    FileEntry *file = entry_at(index);
+
+    ExtentMap *map = extent_map_get(file);
+    if (!map) {
+        printf("ERROR: Cannot allocate extent map\n");
+        return;
+    }
+    size_t have = map->cluster_count;
+    size_t keep = (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+
+    if (size <= file->size) {
+        if (keep == 0) {
+            free_clusters(file);
+        } else if (keep < have) {
+            // The cluster that becomes the last one must be private before its link is cut
+            if (map->shared_from < keep && unshare_cluster(file, keep - 1) == -1) {
+                printf("NO FREE CLUSTERS\n");
+                return;
+            }
+            map = extent_map_get(file);
+            if (!map) {
+                printf("ERROR: Cannot allocate extent map\n");
+                return;
+            }
+            int last = extent_map_lookup(map, keep - 1);
+            int tail = fat[last];
+            fat[last] = FAT_END;
+            file->end_cluster = last;
+            release_chain(tail);
+            extent_map_trim(file, keep);
+        }
+        file->size = size;
+        printf("OK\n");
+        return;
+    }
+
+    // Growing: the old last cluster is zeroed past the old end, new clusters completely
+    char *buffer = calloc(1, MAX_EXTENT_CLUSTERS * CLUSTER_SIZE);
+    if (!buffer) {
+        printf("ERROR: Cannot allocate write buffer\n");
+        return;
+    }
+    if (unshare_tail(file) == -1 || (keep > have && extend_chain(file, keep - have) == -1)) {
+        printf("NO FREE CLUSTERS\n");
+        free(buffer);
+        return;
+    }
+
+    size_t used = file->size % CLUSTER_SIZE;
+    if (used != 0) {
+        map = extent_map_get(file);
+        int cluster = map ? extent_map_lookup(map, have - 1) : -1;
+        if (cluster != -1) {
+            read_cluster_data(cluster, buffer, CLUSTER_SIZE);
+            memset(buffer + used, 0, CLUSTER_SIZE - used);
+            write_cluster_data(cluster, buffer, CLUSTER_SIZE);
+            memset(buffer, 0, CLUSTER_SIZE);
+        }
+    }
+    if (keep > have) {
+        map = extent_map_get(file);
+        int cluster = map ? extent_map_lookup(map, have) : -1;
+        for (size_t left = keep - have; left > 0 && cluster >= 0;) {
+            size_t clusters = left < MAX_EXTENT_CLUSTERS ? left : MAX_EXTENT_CLUSTERS;
+            write_chain_data(&cluster, buffer, clusters * CLUSTER_SIZE);
+            left -= clusters;
+        }
+    }
+    free(buffer);
+    file->size = size;
+    printf("OK\n");
+}
+
+// Set by Ctrl+C while defrag runs; checked between files, so a file is never left half moved
+volatile sig_atomic_t defrag_interrupted = 0;
+
+void defrag_sigint(int sig) {
+    (void)sig;
+    defrag_interrupted = 1;
+}
+
+typedef struct {
+    size_t index;
+    size_t extents;
+} DefragCandidate;
+
+int compare_defrag_candidates(const void *a, const void *b) {
+    const DefragCandidate *x = a, *y = b;
+    return (x->extents < y->extents) - (x->extents > y->extents);  // most fragmented first
+}
+
+// Move a file into one contiguous free run: copy the data, then switch the entry to the new
+// chain and free the old one. Returns -1 (file untouched) when the chain is shared with a
+// clone or no free run is large enough.
+int defrag_file(FileEntry *file) {
+    extent_map_drop(file);
+    size_t clusters = 0;
+    for (int c = file->start_cluster; c >= 0 && c < max_clusters; c = fat[c]) {
+        if (cluster_refs[c] > 1) {
+            return -1;
+        }
+        clusters++;
+    }
+
+    if (free_extent_count == 0 || free_by_size[free_extent_count - 1].count < clusters) {
+        return -1;
+    }
+
+    Extent run;
+    take_free_run(clusters, -1, &run);
+    for (size_t i = 0; i < run.count; i++) {
+        int c = run.start + (int)i;
+        fat[c] = i + 1 < run.count ? c + 1 : FAT_END;
+        cluster_refs[c] = 1;
+    }
+
+    copy_chain_data(file->start_cluster, run.start, clusters * CLUSTER_SIZE);
+
+    FileEntry old_chain = *file;
+    file->start_cluster = run.start;
+    file->end_cluster = run.start + run.count - 1;
+    free_clusters(&old_chain);
+    return 0;
+}
+
+// defrag [path] [--throttle ms] - make fragmented files contiguous, most fragmented first
+void defrag(const char *args) {
+    char path[MAX_PATH_LENGTH] = "";
+    char prefix[MAX_PATH_LENGTH];
+    long throttle_ms = 0;
+
+    char words[3][MAX_PATH_LENGTH];
+    int count = args ? sscanf(args, "%255s %255s %255s", words[0], words[1], words[2]) : 0;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(words[i], "--throttle") == 0 && i + 1 < count) {
+            throttle_ms = strtol(words[++i], NULL, 10);
+        } else if (path[0] == '\0' && words[i][0] != '-') {
+            snprintf(path, MAX_PATH_LENGTH, "%s", words[i]);
+        } else {
+            printf("Usage: defrag [path] [--throttle ms]\n");
+            return;
+        }
+    }
+
+    if (path[0] != '\0') {
+        normalize_path(prefix, path);
+    } else {
+        strcpy(prefix, "/");
+    }
+    int root;  // -1 is the whole volume
+    if (!find_directory(prefix, &root)) {
+        root = find_file(prefix);
+        if (root == -1) {
+            printf("PATH NOT FOUND\n");
+            return;
+        }
+    }
+
+    DefragCandidate *candidates = malloc((file_count + 1) * sizeof(DefragCandidate));
+    if (!candidates) {
+        printf("ERROR: Cannot allocate defrag list\n");
+        return;
+    }
+
+    size_t candidate_count = 0;
+    for (size_t i = 0; i < file_count; i++) {
+        FileEntry *entry = entry_at(i);
+        if (entry_is_free(i) || entry->is_directory || entry->start_cluster == FAT_FREE) {
+            continue;
+        }
+        int ancestor = (int)i;
+        while (ancestor != root && ancestor != -1) {
+            ancestor = entry_at(ancestor)->parent;
+        }
+        if (ancestor != root) {
+            continue;  // outside the requested file or directory
+        }
+
+        size_t extents = count_extents(entry->start_cluster);
+        if (extents > 1) {
+            candidates[candidate_count].index = i;
+            candidates[candidate_count].extents = extents;
+            candidate_count++;
+        }
+    }
+    qsort(candidates, candidate_count, sizeof(DefragCandidate), compare_defrag_candidates);
+
+    struct sigaction action, previous;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = defrag_sigint;
+    sigemptyset(&action.sa_mask);
+    defrag_interrupted = 0;
+    sigaction(SIGINT, &action, &previous);
+
+    size_t moved = 0, skipped = 0, done = 0;
+    for (; done < candidate_count && !defrag_interrupted; done++) {
+        FileEntry *entry = entry_at(candidates[done].index);
+        char path[MAX_PATH_LENGTH];
+        entry_path((int)candidates[done].index, path);
+        if (defrag_file(entry) == 0) {
+            printf("%s: %zu -> 1 extent(s)\n", path, candidates[done].extents);
+            moved++;
+        } else {
+            printf("%s: SKIPPED (%zu extent(s), shared or no contiguous space)\n", path, candidates[done].extents);
+            skipped++;
+        }
+
+        if (throttle_ms > 0 && done + 1 < candidate_count) {
+            struct timespec pause = {throttle_ms / 1000, (throttle_ms % 1000) * 1000000L};
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    sigaction(SIGINT, &previous, NULL);
+    free(candidates);
+
+    if (done < candidate_count) {
+        printf("INTERRUPTED - %zu of %zu fragmented files processed\n", done, candidate_count);
+    }
+    printf("OK - %zu defragmented, %zu skipped\n", moved, skipped);
+}
+
+int execute_command(const char *command) {
+    for (int i = 0; i < sizeof(command_table) / sizeof(command_table[0]); i++) {
+        if (strncmp(command_table[i].command_name, command, strlen(command_table[i].command_name)) == 0) {
+            command_table[i].command_func(command);
+            entry_store_maybe_compact();
+            return 0;
+        }
+    }
+    printf("UNKNOWN COMMAND: %s\n", command);
+    return -1;
+}
+
+int execute_command_with_args(const char *command) {
+    // Find the first space that separates the command name from its arguments
+    const char *space = strchr(command, ' ');
+    char cmd_name[128] = {0};
+    const char *args = NULL;
+
+    if (space) {
+        // Copy the command name
+        strncpy(cmd_name, command, space - command);
+        cmd_name[space - command] = '\0';
+        args = space + 1; // Arguments start immediately after the space
+    } else {
+        // If there is no space, the entire string is the command name
+        strncpy(cmd_name, command, sizeof(cmd_name) - 1);
+    }
+
+    // Search for the command in the table
+    for (int i = 0; i < sizeof(command_table) / sizeof(command_table[0]); i++) {
+        if (strcmp(command_table[i].command_name, cmd_name) == 0) {
+            // Call the function with arguments (or NULL if there are no arguments)
+            command_table[i].command_func(args);
+            entry_store_maybe_compact();
+            return 0;
+        }
+    }
+
+    // If the command is not found
+    printf("UNKNOWN COMMAND: %s\n", cmd_name);
+    return -1;
+}
+
+void load(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        printf("FILE NOT FOUND\n");
+        return;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0'; // Remove the newline character
+
+        // Split command and arguments
+        char cmd_name[128] = {0};
+        char args[128] = {0};
+
+        // Use sscanf to split the line into command name and arguments
+        int parts = sscanf(line, "%127s %127[^\n]", cmd_name, args);
+
+        if (parts >= 1) { // If there is at least a command
+            printf("Executing: %s %s\n", cmd_name, parts == 2 ? args : "");
+            if (parts == 2) {
+                char command[100];
+                snprintf(command, sizeof(command), "%s %s", cmd_name, args);
+                execute_command_with_args(command);
+
+            } else {
+                execute_command(cmd_name);
+            }
+        } else {
+            printf("UNKNOWN COMMAND FORMAT: %s\n", line);
+        }
+    }
+
+    fclose(file);
+    printf("OK\n");
+}
+
+void format(const char *arg) {
+    if (!arg || !*arg) {
+        printf("CANNOT CREATE FILE\n");
+        return;
+    }
+
+    long size = 0;
+    char suffix[8] = {0};
+
+    // Parse string like "600MB", "600KB", or "600"
+    if (sscanf(arg, "%ld%2s", &size, suffix) < 1) {
+        printf("CANNOT CREATE FILE\n");
+        return;
+    }
+
+    // 🔥 Determine size in bytes (default - megabytes)
+    size_t required_size = 0;
+
+    if (suffix[0] == '\0' || strcasecmp(suffix, "MB") == 0) {
+        required_size = (size_t)size * 1024 * 1024;  // Default to MB
+    } else if (strcasecmp(suffix, "KB") == 0) {
+        required_size = (size_t)size * 1024;  // Convert to KB
+    } else {
+        printf("CANNOT CREATE FILE\n");
+        return;
+    }
+
+    if (size <= 0) {
+        printf("CANNOT CREATE FILE\n");
+        return;
+    }
+
+    // Superblock in cluster 0, then the FAT (one int per data cluster), then the data clusters
+    size_t total_clusters = required_size / CLUSTER_SIZE;
+    size_t fat_clusters = (total_clusters * sizeof(int) + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    if (total_clusters < fat_clusters + 2) {
+        printf("CANNOT CREATE FILE\n");
+        return;
+    }
+
+    // Use the file specified at program start (disk_filename)
+    close_disk();
+    FILE *fs_file = fopen(disk_filename, "wb");
+    if (!fs_file) {
+        printf("CANNOT CREATE FILE\n");
+        return;
+    }
+
+    // Set the new file size
+    if (ftruncate(fileno(fs_file), required_size) != 0) {
+        fclose(fs_file);
+        printf("CANNOT CREATE FILE\n");
+        return;
+    }
+
+    fclose(fs_file);
+
+    // Reopen the freshly created image for cluster I/O
+    if (open_disk() != 0) {
+        printf("CANNOT CREATE FILE\n");
+        return;
+    }
+
+    max_clusters = total_clusters - 1 - fat_clusters;
+    fat_offset = CLUSTER_SIZE;
+    data_offset = (off_t)(1 + fat_clusters) * CLUSTER_SIZE;
+
+    printf("_max_clusters: %llu_ / _required_size:%llu_\n", max_clusters, required_size);
+    // Reset and initialize the file system
+    initialize_filesystem();
+    cache_invalidate();
+    write_metadata(0);
+
+    printf("OK\n");
+}
+
+void normalize_path(char *normalized_path, const char *input_path) {
+    if (input_path[0] == '/') {
+        // Already an absolute path
+        strncpy(normalized_path, input_path, MAX_PATH_LENGTH);
+    } else {
+        // Append the current path
+        if (strcmp(current_path, "/") == 0) {
+            snprintf(normalized_path, MAX_PATH_LENGTH, "/%s", input_path);
+        } else {
+            snprintf(normalized_path, MAX_PATH_LENGTH, "%s/%s", current_path, input_path);
+        }
+    }
+
+    // Remove double slashes if they appear
+    char *src = normalized_path, *dst = normalized_path;
+    while (*src) {
+        *dst = *src++;
+        if (*dst != '/' || (dst == normalized_path || *(dst - 1) != '/')) {
+            dst++;
+        }
+    }
+    *dst = '\0';
+}
+
+void bug(const char *arg) {
+    if (arg == NULL || strcmp(arg, "") == 0) {
+        printf("Usage: bug <filename>\n");
+        return;
+    }
+
+    char full_path[MAX_PATH_LENGTH];
+    normalize_path(full_path, arg);
+
+    int index = find_file(full_path);
+    if (index == -1) {
+        printf("FILE %s NOT FOUND\n", full_path);
+        return;
+    }
+
+    FileEntry *entry = entry_at(index);
+
+    if (entry->is_directory) {
+        printf("CANNOT CORRUPT DIRECTORY: %s\n", full_path);
+        return;
+    }
+
+    if (entry->start_cluster == FAT_FREE) {
+        printf("FILE %s has no allocated clusters.\n", full_path);
+        return;
+    }
+
+    // Collect all clusters of the file
+    int cluster_list[MAX_CLUSTERS];
+    int cluster_count = 0;
+    int current = entry->start_cluster;
+
+    while (current != FAT_END) {
+        if (cluster_count >= MAX_CLUSTERS) {
+            printf("ERROR: Too many clusters for file %s\n", full_path);
+            return;
+        }
+        cluster_list[cluster_count++] = current;
+        current = fat[current];
+    }
+
+    // Select a random cluster
+    srand(time(NULL));
+    int random_cluster = cluster_list[rand() % cluster_count];
+
+    // Mark it as corrupted
+    extent_map_drop(entry);
+    fat[random_cluster] = -5;  // Marked as corrupted
+    printf("Corrupted cluster %d of file %s\n", random_cluster, full_path);
+}
+
+// Scalar kernels: the fallback, and the reference for fatbench
+uint64_t fat_free_bits_scalar(const int *entries, size_t count) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < count; i++) {
+        bits |= (uint64_t)(entries[i] == FAT_FREE) << i;
+    }
+    return bits;
+}
+
+// Index of the first entry at or after from that is neither FAT_FREE, FAT_END nor a cluster
+// index below limit, or count when there is none. With FAT_END == -2 and FAT_FREE == -1 the
+// valid values are exactly those with (unsigned)(value + 2) < limit + 2.
+size_t fat_find_invalid_scalar(const int *entries, size_t count, size_t from, int limit) {
+    for (size_t i = from; i < count; i++) {
+        if ((unsigned)entries[i] + 2u >= (unsigned)limit + 2u) {
+            return i;
+        }
+    }
+    return count;
+}
+
+#ifdef HAVE_X86_SIMD
+// SSE2 has no unsigned compare; flipping the sign bit turns it into a signed one
+__attribute__((target("sse2")))
+uint64_t fat_free_bits_sse2(const int *entries, size_t count) {
+    const __m128i free_value = _mm_set1_epi32(FAT_FREE);
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(entries + i));
+        bits |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, free_value))) << i;
+    }
+    // A full word leaves no tail, and shifting by 64 would be undefined
+    if (i < count) {
+        bits |= fat_free_bits_scalar(entries + i, count - i) << i;
+    }
+    return bits;
+}
+
+__attribute__((target("sse2")))
+size_t fat_find_invalid_sse2(const int *entries, size_t count, size_t from, int limit) {
+    const __m128i bias = _mm_set1_epi32((int)(2u ^ 0x80000000u));
+    const __m128i bound = _mm_set1_epi32((int)(((unsigned)limit + 2u) ^ 0x80000000u));
+    size_t i = from;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_add_epi32(_mm_loadu_si128((const __m128i *)(entries + i)), bias);
+        if (_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(v, bound))) != 0xf) {
+            return fat_find_invalid_scalar(entries, i + 4, i, limit);
+        }
+    }
+    return fat_find_invalid_scalar(entries, count, i, limit);
+}
+
+__attribute__((target("avx2")))
+uint64_t fat_free_bits_avx2(const int *entries, size_t count) {
+    const __m256i free_value = _mm256_set1_epi32(FAT_FREE);
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(entries + i));
+        bits |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, free_value))) << i;
+    }
+    // A full word leaves no tail, and shifting by 64 would be undefined
+    if (i < count) {
+        bits |= fat_free_bits_scalar(entries + i, count - i) << i;
+    }
+    return bits;
+}
+
+__attribute__((target("avx2")))
+size_t fat_find_invalid_avx2(const int *entries, size_t count, size_t from, int limit) {
+    const __m256i bias = _mm256_set1_epi32((int)(2u ^ 0x80000000u));
+    const __m256i bound = _mm256_set1_epi32((int)(((unsigned)limit + 2u) ^ 0x80000000u));
+    size_t i = from;
+    // Two vectors (16 entries) per iteration; one branch covers both
+    for (; i + 16 <= count; i += 16) {
+        __m256i a = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(entries + i)), bias);
+        __m256i b = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(entries + i + 8)), bias);
+        __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi32(bound, a), _mm256_cmpgt_epi32(bound, b));
+        if (_mm256_movemask_ps(_mm256_castsi256_ps(ok)) != 0xff) {
+            return fat_find_invalid_scalar(entries, i + 16, i, limit);
+        }
+    }
+    return fat_find_invalid_scalar(entries, count, i, limit);
+}
+#endif
+
+const FatKernels fat_kernel_table[] = {
+    {"scalar", fat_free_bits_scalar, fat_find_invalid_scalar},
+#ifdef HAVE_X86_SIMD
+    {"sse2", fat_free_bits_sse2, fat_find_invalid_sse2},
+    {"avx2", fat_free_bits_avx2, fat_find_invalid_avx2},
+#endif
+};
+const FatKernels *fat_kernels = &fat_kernel_table[0];
+
+// Pick the widest kernels the CPU supports
+void select_fat_kernels() {
+    fat_kernels = &fat_kernel_table[0];
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        fat_kernels = &fat_kernel_table[2];
+    } else if (__builtin_cpu_supports("sse2")) {
+        fat_kernels = &fat_kernel_table[1];
+    }
+#endif
+}
+
+// Count the free entries of a FAT range with the active kernel. Only fatbench needs the bare
+// count; rebuild_free_space keeps the bit words themselves.
+size_t fat_count_free(const int *entries, size_t count) {
+    size_t free_count = 0;
+    for (size_t i = 0; i < count; i += 64) {
+        free_count += (size_t)__builtin_popcountll(fat_kernels->free_bits(entries + i, count - i < 64 ? count - i : 64));
+    }
+    return free_count;
+}
+
+double elapsed_ms(struct timespec start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start.tv_sec) * 1e3 + (double)(now.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+// fatbench [million_clusters] - time every FAT scan kernel on a synthetic FAT
+void fatbench(const char *arg) {
+    long millions = 4;
+    if (arg && *arg && (sscanf(arg, "%ld", &millions) != 1 || millions <= 0)) {
+        printf("Usage: fatbench [million_clusters]\n");
+        return;
+    }
+
+    size_t count = (size_t)millions * 1000000;
+    int *entries = malloc(count * sizeof(int));
+    if (!entries) {
+        printf("ERROR: Cannot allocate %ld M entries\n", millions);
+        return;
+    }
+
+    // Roughly half free, the rest chained; no corrupted entries so every scan runs to the end
+    srand(1);
+    for (size_t i = 0; i < count; i++) {
+        int r = rand() % 4;
+        entries[i] = r < 2 ? FAT_FREE : r == 2 ? FAT_END : (int)((i + 1) % count);
+    }
+
+    const int rounds = 5;
+    double base_count = 0, base_scan = 0;
+    printf("%zu clusters (%zu MB of FAT), best of %d runs\n", count, count * sizeof(int) / 1024 / 1024, rounds);
+    for (size_t k = 0; k < sizeof(fat_kernel_table) / sizeof(fat_kernel_table[0]); k++) {
+#ifdef HAVE_X86_SIMD
+        if ((k == 1 && !__builtin_cpu_supports("sse2")) || (k == 2 && !__builtin_cpu_supports("avx2"))) {
+            continue;
+        }
+#endif
+        const FatKernels *saved = fat_kernels;
+        fat_kernels = &fat_kernel_table[k];
+
+        double best_count = 1e30, best_scan = 1e30;
+        size_t free_count = 0, invalid = 0;
+        for (int r = 0; r < rounds; r++) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            free_count = fat_count_free(entries, count);
+            double ms = elapsed_ms(start);
+            best_count = ms < best_count ? ms : best_count;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            invalid = fat_kernels->find_invalid(entries, count, 0, (int)count);
+            ms = elapsed_ms(start);
+            best_scan = ms < best_scan ? ms : best_scan;
+        }
+        fat_kernels = saved;
+
+        if (k == 0) {
+            base_count = best_count;
+            base_scan = best_scan;
+        }
+        printf("%-6s count free: %8.2f ms (%5.2fx, %zu free)  range scan: %8.2f ms (%5.2fx%s)\n",
+               fat_kernel_table[k].name, best_count, base_count / best_count, free_count,
+               best_scan, base_scan / best_scan, invalid == count ? "" : ", MISMATCH");
+    }
+    printf("active kernels: %s\n", fat_kernels->name);
+    free(entries);
+}
+
+void check() {
+    int corrupted_found = 0;
+
+    // Valid cluster values: FAT_FREE, FAT_END, or a valid cluster index
+    size_t i = 0;
+    while ((i = fat_kernels->find_invalid(fat, max_clusters, i, (int)max_clusters)) < max_clusters) {
+        printf("Cluster %zu is corrupted: value %d\n", i, fat[i]);
+        corrupted_found++;
+        i++;
+    }
+
+    // Shared (cloned) chains: every cluster must be referenced exactly as often as
+    // file starts and FAT links point at it
+    int *expected = calloc(max_clusters, sizeof(int));
+    if (!expected) {
+        printf("ERROR: Cannot allocate reference table\n");
+        return;
+    }
+    count_cluster_references(expected);
+
+    // The free-space bitmap and counter have to agree with the FAT, compared a word at a time
+    size_t free_found = 0;
+    for (size_t word = 0; word * 64 < max_clusters; word++) {
+        size_t base = word * 64;
+        uint64_t bits = fat_kernels->free_bits(fat + base, max_clusters - base < 64 ? max_clusters - base : 64);
+        uint64_t differ = bits ^ free_bitmap[word];
+        while (differ) {
+            int bit = __builtin_ctzll(differ);
+            printf("Cluster %zu is %s in the free-space bitmap\n", base + bit,
+                   (free_bitmap[word] >> bit) & 1 ? "free" : "used");
+            corrupted_found++;
+            differ &= differ - 1;
+        }
+        free_found += (size_t)__builtin_popcountll(bits);
+    }
+    if (free_found != free_cluster_count) {
+        printf("Free cluster counter is %zu, FAT has %zu\n", free_cluster_count, free_found);
+        corrupted_found++;
+    }
+
+    // Every indexed free extent must be free in the FAT, and together they cover all free clusters
+    size_t indexed = 0;
+    for (size_t e = 0; e < free_extent_count; e++) {
+        for (size_t i = 0; i < free_by_offset[e].count; i++) {
+            int c = free_by_offset[e].start + (int)i;
+            if (c >= max_clusters || fat[c] != FAT_FREE) {
+                printf("Cluster %d is in the free-extent index but not free\n", c);
+                corrupted_found++;
+                break;
+            }
+        }
+        indexed += free_by_offset[e].count;
+    }
+    if (indexed != free_found) {
+        printf("Free-extent index holds %zu clusters, FAT has %zu free\n", indexed, free_found);
+        corrupted_found++;
+    }
+
+    int shared = 0;
+    for (int i = 0; i < max_clusters; i++) {
+        if (expected[i] != cluster_refs[i]) {
+            printf("Cluster %d has %d references, expected %d\n", i, cluster_refs[i], expected[i]);
+            corrupted_found++;
+        } else if (expected[i] > 1) {
+            shared++;
+        }
+    }
+    free(expected);
+
+    if (shared > 0)
+        printf("Shared chains join at %d clusters\n", shared);
+    if (corrupted_found == 0)
+        printf("Filesystem is OK\n");
+    else
+        printf("Total corrupted clusters found: %d\n", corrupted_found);
+}
+
+int count_free_clusters() {
+    return (int)free_cluster_count;
+}
+
+// Add up how often every cluster is referenced: by file starts, by the directory table start
+// and by FAT links. check compares the result with cluster_refs; mount rebuilds them from it.
+void count_cluster_references(int *refs) {
+    for (size_t i = 0; i < file_count; i++) {
+        int start = (int)entry_at(i)->start_cluster;
+        if (!entry_is_free(i) && !entry_at(i)->is_directory && start >= 0 && start < max_clusters) {
+            refs[start]++;
+        }
+    }
+    int start = (int)directory_table.start_cluster;
+    if (start >= 0 && start < max_clusters) {
+        refs[start]++;
+    }
+    for (int i = 0; i < max_clusters; i++) {
+        if (fat[i] >= 0 && fat[i] < max_clusters) {
+            refs[fat[i]]++;
+        }
+    }
+}
+
+int compare_extents_by_size(const void *a, const void *b) {
+    const Extent *x = a, *y = b;
+    if (x->count != y->count) {
+        return x->count < y->count ? -1 : 1;
+    }
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// Derive the free-space bitmap, its counter and the free-extent index from a FAT read from disk
+void rebuild_free_space() {
+    size_t words = (max_clusters + 63) / 64;
+    free_cluster_count = 0;
+    for (size_t word = 0; word < words; word++) {
+        size_t base = word * 64;
+        free_bitmap[word] = fat_kernels->free_bits(fat + base, max_clusters - base < 64 ? max_clusters - base : 64);
+        free_cluster_count += (size_t)__builtin_popcountll(free_bitmap[word]);
+    }
+
+    // Runs of set bits become extents; whole used or free words are skipped at once
+    free_extent_count = 0;
+    size_t c = 0;
+    while (c < max_clusters) {
+        uint64_t free_bits = free_bitmap[c / 64] & (~UINT64_C(0) << (c % 64));
+        if (!free_bits) {
+            c = (c / 64 + 1) * 64;
+            continue;
+        }
+        size_t start = c / 64 * 64 + (size_t)__builtin_ctzll(free_bits);
+        c = start;
+        while (c < max_clusters) {
+            uint64_t used_bits = ~free_bitmap[c / 64] & (~UINT64_C(0) << (c % 64));
+            if (used_bits) {
+                c = c / 64 * 64 + (size_t)__builtin_ctzll(used_bits);
+                break;
+            }
+            c = (c / 64 + 1) * 64;
+        }
+        if (c > max_clusters) {
+            c = max_clusters;
+        }
+
+        if (free_extent_count == free_extent_capacity) {
+            size_t capacity = free_extent_capacity * 2;
+            Extent *by_offset = realloc(free_by_offset, capacity * sizeof(Extent));
+            Extent *by_size = by_offset ? realloc(free_by_size, capacity * sizeof(Extent)) : NULL;
+            if (!by_offset || !by_size) {
+                printf("ERROR: Cannot grow free-extent index\n");
+                exit(EXIT_FAILURE);
+            }
+            free_by_offset = by_offset;
+            free_by_size = by_size;
+            free_extent_capacity = capacity;
+        }
+        free_by_offset[free_extent_count].start = (int)start;
+        free_by_offset[free_extent_count].count = c - start;
+        free_extent_count++;
+    }
+    memcpy(free_by_size, free_by_offset, free_extent_count * sizeof(Extent));
+    qsort(free_by_size, free_extent_count, sizeof(Extent), compare_extents_by_size);
+}
+
+// FNV-1a over the superblock fields in front of the checksum
+uint32_t superblock_checksum(const Superblock *sb) {
+    const unsigned char *bytes = (const unsigned char *)sb;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(Superblock, checksum); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Make everything written so far durable before the next metadata step
+void sync_disk() {
+    if (disk_map) {
+        msync(disk_map, disk_map_size, MS_SYNC);
+    }
+    if (disk_fd >= 0) {
+        fsync(disk_fd);
+    }
+}
+
+void write_superblock(int clean) {
+    Superblock sb;
+    memset(&sb, 0, sizeof(sb));
+    memcpy(sb.magic, SUPERBLOCK_MAGIC, sizeof(sb.magic));
+    sb.version = SUPERBLOCK_VERSION;
+    sb.cluster_size = CLUSTER_SIZE;
+    sb.cluster_count = max_clusters;
+    sb.fat_offset = (uint64_t)fat_offset;
+    sb.data_offset = (uint64_t)data_offset;
+    sb.directory_start = (int32_t)directory_table.start_cluster;
+    sb.directory_clusters = (uint32_t)directory_clusters;
+    sb.directory_bytes = directory_table.size;
+    sb.entry_count = (uint32_t)directory_entries;
+    sb.clean = (uint32_t)clean;
+    sb.checksum = superblock_checksum(&sb);
+    disk_write(0, (const char *)&sb, sizeof(sb));
+    sync_disk();
+}
+
+// Persist the directory table, then the FAT, then the superblock. The table and the FAT are
+// overwritten in place, so this is not crash safe: a crash part way leaves the old superblock
+// over new or half-written metadata. Mount marks the superblock dirty, so the next mount warns.
+// The directory chain only ever grows. clean is set on unmount.
+int write_metadata(int clean) {
+    if (disk_fd < 0 || data_offset == 0) {
+        return -1;
+    }
+
+    entry_store_compact();  // records refer to their parents by position
+    size_t bytes = directory_record_bytes;
+    size_t needed = (bytes + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    if (needed > directory_clusters) {
+        // Allocations keep this much free, but an image filled before that was checked may not have it
+        size_t grow = needed - directory_clusters;
+        if (grow > (size_t)count_free_clusters()) {
+            grow = count_free_clusters();
+        }
+        if (grow > 0 && extend_chain(&directory_table, grow) != -1) {
+            directory_clusters += grow;
+        }
+    }
+
+    // When the table still cannot hold every record, save the ones that fit and leave out whole
+    // subtrees, so every saved record's parent is saved too; the FAT and superblock are written
+    // either way. saved_at[i] is the position of entry i's record, or -1 when it is left out.
+    int *saved_at = NULL;
+    size_t saved = file_count;
+    if (bytes > directory_clusters * CLUSTER_SIZE) {
+        saved_at = malloc((file_count ? file_count : 1) * sizeof(int));
+        if (!saved_at) {
+            printf("ERROR: Cannot allocate directory table\n");
+            return -1;
+        }
+        size_t used = 0;
+        for (size_t i = 0; i < file_count; i++) {
+            size_t size = record_size(entry_at(i)->name);
+            saved_at[i] = used + size <= directory_clusters * CLUSTER_SIZE ? 0 : -1;
+            used += saved_at[i] == 0 ? size : 0;
+        }
+        // A parent may come after its children, so repeat until no more records drop out
+        for (int changed = 1; changed;) {
+            changed = 0;
+            for (size_t i = 0; i < file_count; i++) {
+                int parent = entry_at(i)->parent;
+                if (saved_at[i] != -1 && parent != -1 && saved_at[parent] == -1) {
+                    saved_at[i] = -1;
+                    changed = 1;
+                }
+            }
+        }
+        saved = 0;
+        bytes = 0;
+        for (size_t i = 0; i < file_count; i++) {
+            if (saved_at[i] != -1) {
+                saved_at[i] = (int)saved++;
+                bytes += record_size(entry_at(i)->name);
+            }
+        }
+        printf("ERROR: No space left for the directory table, %zu of %zu entries not saved\n",
+               file_count - saved, file_count);
+    }
+
+    char *buffer = calloc(1, bytes ? bytes : 1);
+    if (!buffer) {
+        printf("ERROR: Cannot allocate directory table\n");
+        free(saved_at);
+        return -1;
+    }
+    size_t position = 0;
+    for (size_t i = 0; i < file_count; i++) {
+        if (saved_at && saved_at[i] == -1) {
+            continue;
+        }
+        int parent = entry_at(i)->parent;
+        DirectoryRecord record;
+        memset(&record, 0, sizeof(record));
+        record.size = entry_at(i)->size;
+        record.start_cluster = (int32_t)entry_at(i)->start_cluster;
+        record.end_cluster = (int32_t)entry_at(i)->end_cluster;
+        record.parent = saved_at && parent != -1 ? saved_at[parent] : parent;
+        record.name_length = (uint16_t)strlen(entry_at(i)->name);
+        record.is_directory = (uint8_t)entry_at(i)->is_directory;
+        memcpy(buffer + position, &record, sizeof(record));
+        memcpy(buffer + position + sizeof(record), entry_at(i)->name, record.name_length);
+        position += sizeof(record) + record.name_length;
+    }
+    free(saved_at);
+    // The chain I/O moves one window per call
+    int cluster = (int)directory_table.start_cluster;
+    for (size_t done = 0; done < bytes; done += MAX_EXTENT_CLUSTERS * CLUSTER_SIZE) {
+        size_t window = bytes - done < MAX_EXTENT_CLUSTERS * CLUSTER_SIZE ? bytes - done : MAX_EXTENT_CLUSTERS * CLUSTER_SIZE;
+        write_chain_data(&cluster, buffer + done, window);
+    }
+    free(buffer);
+    directory_table.size = bytes;
+    directory_entries = saved;
+
+    cache_flush();
+    disk_write(fat_offset, (const char *)fat, max_clusters * sizeof(int));
+    sync_disk();
+    write_superblock(clean);
+    return saved == file_count ? 0 : -1;
+}
+
+// Mount the image: check the superblock, then read the FAT and the directory table in bulk.
+// FAT values are not validated here; free space and reference counts are derived from them
+// and check does the full consistency pass when asked.
+// Returns 0, MOUNT_NO_FILESYSTEM or MOUNT_CORRUPTED.
+int mount_filesystem() {
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    struct stat st;
+    Superblock sb;
+    if (disk_fd < 0 || fstat(disk_fd, &st) != 0 || (size_t)st.st_size < sizeof(sb)) {
+        return MOUNT_NO_FILESYSTEM;
+    }
+    disk_read(0, (char *)&sb, sizeof(sb));
+    if (memcmp(sb.magic, SUPERBLOCK_MAGIC, sizeof(sb.magic)) != 0) {
+        return MOUNT_NO_FILESYSTEM;
+    }
+    if (sb.version != SUPERBLOCK_VERSION) {
+        printf("ERROR: %s has on-disk format version %u, this build reads %d\n", disk_filename, sb.version,
+               SUPERBLOCK_VERSION);
+        return MOUNT_CORRUPTED;
+    }
+    if (sb.checksum != superblock_checksum(&sb) ||
+        sb.cluster_size != CLUSTER_SIZE || sb.cluster_count == 0 || sb.cluster_count > INT_MAX ||
+        sb.fat_offset < sizeof(sb) || sb.fat_offset + sb.cluster_count * sizeof(int) > sb.data_offset ||
+        sb.data_offset + sb.cluster_count * CLUSTER_SIZE > (uint64_t)st.st_size ||
+        sb.entry_count > sb.directory_bytes / sizeof(DirectoryRecord) || sb.directory_bytes > (uint64_t)sb.directory_clusters * CLUSTER_SIZE ||
+        (sb.directory_clusters && (sb.directory_start < 0 || (uint64_t)sb.directory_start >= sb.cluster_count))) {
+        printf("ERROR: Corrupted superblock in %s\n", disk_filename);
+        return MOUNT_CORRUPTED;
+    }
+
+    max_clusters = sb.cluster_count;
+    fat_offset = (off_t)sb.fat_offset;
+    data_offset = (off_t)sb.data_offset;
+    initialize_filesystem();
+    cache_invalidate();
+    disk_read(fat_offset, (char *)fat, max_clusters * sizeof(int));
+
+    // The directory chain has to be intact before it can be read; its tail is needed to grow it
+    directory_clusters = sb.directory_clusters;
+    directory_table.size = sb.directory_bytes;
+    if (directory_clusters > 0) {
+        int cluster = sb.directory_start;
+        for (size_t i = 1; i < directory_clusters; i++) {
+            cluster = fat[cluster];
+            if (cluster < 0 || cluster >= max_clusters) {
+                printf("ERROR: Directory table chain is broken\n");
+                return MOUNT_CORRUPTED;
+            }
+        }
+        directory_table.start_cluster = sb.directory_start;
+        directory_table.end_cluster = cluster;
+    }
+
+    char *buffer = malloc(sb.directory_bytes ? sb.directory_bytes : 1);
+    if (!buffer) {
+        printf("ERROR: Cannot allocate directory table\n");
+        return MOUNT_CORRUPTED;
+    }
+    int cluster = sb.directory_start;
+    for (size_t done = 0; done < sb.directory_bytes; done += MAX_EXTENT_CLUSTERS * CLUSTER_SIZE) {
+        size_t window = sb.directory_bytes - done < MAX_EXTENT_CLUSTERS * CLUSTER_SIZE ?
+                        sb.directory_bytes - done : MAX_EXTENT_CLUSTERS * CLUSTER_SIZE;
+        read_chain_data(&cluster, buffer + done, window);
+    }
+    entry_store_reserve(sb.entry_count);
+    size_t position = 0;
+    while (file_count < sb.entry_count && position + sizeof(DirectoryRecord) <= sb.directory_bytes) {
+        DirectoryRecord record;
+        memcpy(&record, buffer + position, sizeof(record));
+        position += sizeof(record);
+        if (record.name_length == 0 ||
+            position + record.name_length > sb.directory_bytes) {
+            break;
+        }
+
+        FileEntry *entry = entry_at(file_count++);
+        entry->name = intern_name(buffer + position, record.name_length);
+        entry->size = record.size;
+        entry->start_cluster = record.start_cluster;
+        entry->end_cluster = record.end_cluster;
+        entry->is_directory = record.is_directory;
+        entry->parent = record.parent;
+        entry->extents = NULL;
+        position += record.name_length;
+    }
+    free(buffer);
+    if (file_count != sb.entry_count) {
+        printf("ERROR: Directory table is damaged after %zu of %u entries\n", file_count, sb.entry_count);
+        return MOUNT_CORRUPTED;
+    }
+    directory_entries = file_count;
+    directory_record_bytes = position;
+
+    // Parents can only be checked once every record is in; then the tree and index are built
+    for (size_t i = 0; i < file_count; i++) {
+        int parent = entry_at(i)->parent;
+        if (parent < -1 || parent >= (int)file_count || parent == (int)i ||
+            (parent != -1 && !entry_at(parent)->is_directory)) {
+            printf("ERROR: Directory table entry %zu has a bad parent\n", i);
+            return MOUNT_CORRUPTED;
+        }
+    }
+    // Every parent chain has to reach the root, or the walks up the tree never end. An entry is
+    // marked 1 while its chain is followed and 2 once the chain is known to reach the root.
+    char *reaches_root = calloc(file_count ? file_count : 1, 1);
+    if (!reaches_root) {
+        printf("ERROR: Cannot allocate directory table\n");
+        return MOUNT_CORRUPTED;
+    }
+    for (size_t i = 0; i < file_count; i++) {
+        int entry = (int)i;
+        while (entry != -1 && reaches_root[entry] == 0) {
+            reaches_root[entry] = 1;
+            entry = entry_at(entry)->parent;
+        }
+        if (entry != -1 && reaches_root[entry] == 1) {
+            printf("ERROR: Directory table entry %d is its own ancestor\n", entry);
+            free(reaches_root);
+            return MOUNT_CORRUPTED;
+        }
+        for (entry = (int)i; entry != -1 && reaches_root[entry] == 1; entry = entry_at(entry)->parent) {
+            reaches_root[entry] = 2;
+        }
+    }
+    free(reaches_root);
+    tree_rebuild();
+    path_index_rebuild();
+
+    rebuild_free_space();
+    count_cluster_references(cluster_refs);
+
+    if (!sb.clean) {
+        printf("WARNING: %s was not unmounted cleanly; metadata may be partly written, run check\n", disk_filename);
+    }
+    write_superblock(0);
+    printf("Mounted %s: %zu clusters, %zu entries in %.2f ms\n", disk_filename, max_clusters, file_count,
+           elapsed_ms(started));
+    return 0;
+}
+
+// Open the image named on the command line; all cluster I/O goes through this descriptor
+int open_disk() {
+    close_disk();
+
+    disk_fd = open(disk_filename, O_RDWR | O_CREAT, 0644);
+    if (disk_fd < 0) {
+        printf("ERROR: Cannot open filesystem file (errno: %d)\n", errno);
+        return -1;
+    }
+
+    // An empty image (before the first format) cannot be mapped yet; format remaps it
+    if (use_mmap) {
+        map_disk();
     }
+    return 0;
+}
 
-    // is destination a dir
-    int dest_index = find_file(dest_path);
-    if (dest_index != -1 && filesystem[dest_index].is_directory) {
-        snprintf(dest_path, MAX_PATH_LENGTH, "%s/%s", dest_path, strrchr(src_path, '/') ? strrchr(src_path, '/') + 1 : src_path);
-        normalize_path(dest_path, dest_path);
+// Map the whole image; cluster I/O then becomes memcpy against the mapping
+int map_disk() {
+    struct stat st;
+    if (disk_fd < 0 || fstat(disk_fd, &st) != 0 || st.st_size == 0) {
+        return -1;
     }
 
-    // Проверяем, существует ли уже файл/папка с таким именем
-    if (find_file(dest_path) != -1) {
-        printf("PATH ALREADY EXISTS\n");
-        return;
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+    if (map == MAP_FAILED) {
+        printf("ERROR: Cannot map filesystem file (errno: %d)\n", errno);
+        return -1;
     }
 
-    strncpy(filesystem[src_index].filename, dest_path, MAX_PATH_LENGTH);
-    printf("OK\n");
+    disk_map = map;
+    disk_map_size = (size_t)st.st_size;
+    return 0;
 }
 
-void free_clusters(FileEntry *file) {
-    if (file->start_cluster == FAT_FREE) {
-        return; // no allocated clusters
+void unmap_disk() {
+    if (disk_map) {
+        if (msync_policy != MSYNC_NONE) {
+            msync(disk_map, disk_map_size, MS_SYNC);
+        }
+        munmap(disk_map, disk_map_size);
+        disk_map = NULL;
+        disk_map_size = 0;
     }
+}
 
-    int current = file->start_cluster;
-    while (current != FAT_END) {
-        int next = fat[current];
-        fat[current] = FAT_FREE; // free cluster
-        current = next;
+void close_disk() {
+    unmap_disk();
+    if (disk_fd >= 0) {
+        close(disk_fd);
+        disk_fd = -1;
     }
+}
 
-    file->start_cluster = FAT_FREE;
-    file->end_cluster = FAT_FREE;
+// Byte offset of a data cluster in the image, and back
+off_t cluster_offset(int cluster) {
+    return data_offset + (off_t)cluster * CLUSTER_SIZE;
 }
 
-void rm(const char *filename) {
-    char full_path[MAX_PATH_LENGTH];
-    normalize_path(full_path, filename);
+int offset_cluster(off_t offset) {
+    return (int)((offset - data_offset) / CLUSTER_SIZE);
+}
 
-    int index = find_file(full_path);
-    if (index == -1) {
-        printf("FILE NOT FOUND\n");
+// Blocking read at a byte offset of the image (mapping or pread)
+void disk_read(off_t offset, char *buffer, size_t size) {
+    if (disk_map && offset + size <= disk_map_size) {
+        memcpy(buffer, disk_map + offset, size);
         return;
     }
 
-    FileEntry *file = &filesystem[index];
-    if (file->is_directory) {
-        printf("CANNOT REMOVE DIRECTORY WITH rm: %s\n", full_path);
-        return;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(disk_fd, buffer + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // Short image (or read error) - the rest of the cluster reads as zeros
+            memset(buffer + done, 0, size - done);
+            break;
+        }
+        done += n;
     }
+}
 
-    free_clusters(file);
+// Blocking write at a byte offset of the image (mapping or pwrite)
+void disk_write(off_t offset, const char *data, size_t size) {
+    if (disk_map && offset + size <= disk_map_size) {
+        memcpy(disk_map + offset, data, size);
+        if (msync_policy != MSYNC_NONE) {
+            // msync wants a page-aligned address; clusters are page multiples on common systems
+            size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            size_t start = (size_t)offset & ~(page - 1);
+            msync(disk_map + start, (size_t)offset + size - start,
+                  msync_policy == MSYNC_SYNC ? MS_SYNC : MS_ASYNC);
+        }
+        return;
+    }
 
-    for (size_t i = index; i < file_count - 1; i++) {
-        filesystem[i] = filesystem[i + 1];
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(disk_fd, data + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            printf("ERROR: Cannot write at offset %lld (errno: %d)\n", (long long)(offset + done), errno);
+            return;
+        }
+        done += n;
     }
-    file_count--;
+}
 
-    printf("OK\n");
+void cache_unlink(int slot) {
+    CacheSlot *entry = &cache_slots[slot];
+    if (entry->prev != -1) {
+        cache_slots[entry->prev].next = entry->next;
+    } else {
+        cache_mru = entry->next;
+    }
+    if (entry->next != -1) {
+        cache_slots[entry->next].prev = entry->prev;
+    } else {
+        cache_lru = entry->prev;
+    }
+    entry->prev = entry->next = -1;
 }
 
-// Function to display file content
-void cat(const char *filename) {
-    char full_path[MAX_PATH_LENGTH];
-    normalize_path(full_path, filename);
+void cache_push_front(int slot) {
+    cache_slots[slot].prev = -1;
+    cache_slots[slot].next = cache_mru;
+    if (cache_mru != -1) {
+        cache_slots[cache_mru].prev = slot;
+    }
+    cache_mru = slot;
+    if (cache_lru == -1) {
+        cache_lru = slot;
+    }
+}
 
-    int file_index = find_file(full_path);
-    if (file_index == -1 || filesystem[file_index].is_directory) {
-        printf("FILE NOT FOUND\n");
-        return;
+// Slot holding the cluster (moved to the front of the LRU list), or -1
+int cache_lookup(int cluster) {
+    if (!cache_index || cluster < 0 || (size_t)cluster >= cache_index_size) {
+        return -1;
     }
 
-    FileEntry *file = &filesystem[file_index];
+    int slot = cache_index[cluster];
+    if (slot != -1 && slot != cache_mru) {
+        cache_unlink(slot);
+        cache_push_front(slot);
+    }
+    return slot;
+}
 
-    if (file->size == 0) {
-        printf("FILE EMPTY\n");
-        return;
+void cache_write_back(int slot) {
+    CacheSlot *entry = &cache_slots[slot];
+    if (entry->dirty) {
+        disk_write(cluster_offset(entry->cluster), cache_data + (size_t)slot * CLUSTER_SIZE, CLUSTER_SIZE);
+        entry->dirty = 0;
+        cache_writebacks++;
     }
+}
 
-    size_t cluster_index = file->start_cluster;
-    size_t bytes_left = file->size;
-    char buffer[CLUSTER_SIZE];
+// Take a slot for the cluster, evicting (and writing back) the least recently used one when full
+int cache_insert(int cluster) {
+    if (!cache_index || cluster < 0 || (size_t)cluster >= cache_index_size) {
+        return -1;
+    }
 
-    while (bytes_left > 0 && cluster_index != FAT_END) {
-        size_t to_read = (bytes_left > CLUSTER_SIZE) ? CLUSTER_SIZE : bytes_left;
+    int slot;
+    if (cache_used < cache_capacity) {
+        slot = cache_used++;
+    } else {
+        slot = cache_lru;
+        cache_write_back(slot);
+        cache_unlink(slot);
+        cache_index[cache_slots[slot].cluster] = -1;
+    }
 
-        // read data from clusters
-        read_cluster_data(cluster_index, buffer, to_read);
-        fwrite(buffer, 1, to_read, stdout);
+    cache_slots[slot].cluster = cluster;
+    cache_slots[slot].dirty = 0;
+    cache_index[cluster] = slot;
+    cache_push_front(slot);
+    return slot;
+}
 
-        bytes_left -= to_read;
-        cluster_index = fat[cluster_index];  // next cluster
+// Write every dirty cluster back to the image (sync, drop_caches, exit)
+void cache_flush() {
+    for (int i = 0; i < cache_used; i++) {
+        cache_write_back(i);
     }
+}
 
-    printf("\n");
+// Forget the cached clusters without writing them back (the image was recreated by format)
+void cache_invalidate() {
+    cache_configure(cache_mb);
 }
 
-void info(const char *name) {
-    if (!name || strlen(name) == 0) {
-        printf("INVALID ARGUMENTS\n");
-        return;
+// (Re)create the cache with size_mb megabytes of cluster slots; 0 disables it.
+// The cluster index follows max_clusters, so format calls this through cache_invalidate.
+int cache_configure(size_t size_mb) {
+    free(cache_slots);
+    free(cache_data);
+    free(cache_index);
+    cache_slots = NULL;
+    cache_data = NULL;
+    cache_index = NULL;
+    cache_index_size = 0;
+    cache_capacity = cache_used = 0;
+    cache_mru = cache_lru = -1;
+    cache_mb = size_mb;
+
+    size_t slots = size_mb * 1024 * 1024 / CLUSTER_SIZE;
+    if (slots == 0) {
+        return 0;
     }
 
-    char full_path[MAX_PATH_LENGTH];
-    normalize_path(full_path, name);  // Convert relative path to absolute path
+    cache_slots = malloc(slots * sizeof(CacheSlot));
+    cache_data = malloc(slots * CLUSTER_SIZE);
+    cache_index = malloc(max_clusters * sizeof(int));
+    if (!cache_slots || !cache_data || !cache_index) {
+        free(cache_slots);
+        free(cache_data);
+        free(cache_index);
+        cache_slots = NULL;
+        cache_data = NULL;
+        cache_index = NULL;
+        cache_mb = 0;
+        return -1;
+    }
 
-    int index = find_file(full_path);
-    if (index == -1) {
-        printf("FILE NOT FOUND\n");
-        return;
+    for (size_t i = 0; i < max_clusters; i++) {
+        cache_index[i] = -1;
     }
+    cache_index_size = max_clusters;
+    cache_capacity = (int)slots;
+    return 0;
+}
 
-    FileEntry *file = &filesystem[index];
+// Drop cached copies of a cluster range that was rewritten behind the cache's back.
+// Callers flush first, so nothing dirty is lost.
+void cache_forget(int cluster, size_t count) {
+    for (size_t i = 0; i < count && cache_index; i++) {
+        int c = cluster + (int)i;
+        if (c < 0 || (size_t)c >= cache_index_size || cache_index[c] == -1) {
+            continue;
+        }
 
-    // If the entry is a directory, no clusters are allocated
-    if (file->is_directory) {
-        printf("%s: Is a directory, no clusters allocated\n", file->filename);
-        return;
+        // Move the last used slot into the hole so that slots [0, cache_used) stay packed
+        int slot = cache_index[c];
+        int last = cache_used - 1;
+        cache_unlink(slot);
+        cache_index[c] = -1;
+        if (slot != last) {
+            cache_unlink(last);
+            cache_slots[slot] = cache_slots[last];
+            memcpy(cache_data + (size_t)slot * CLUSTER_SIZE, cache_data + (size_t)last * CLUSTER_SIZE, CLUSTER_SIZE);
+            cache_index[cache_slots[slot].cluster] = slot;
+            cache_push_front(slot);
+        }
+        cache_used--;
     }
+}
 
-    // If the file has no allocated clusters
-    if (file->start_cluster == FAT_FREE) {
-        printf("%s: No clusters allocated\n", file->filename);
-        return;
-    }
+// Serve a chain read request from the cache if every cluster it covers is cached
+int cache_serve_read(IoRequest *request) {
+    int first = offset_cluster(request->offset);
+    int clusters = (int)((request->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
 
-    printf("%s: Clusters ", file->filename);
+    for (int i = 0; i < clusters; i++) {
+        if (!cache_index || first + i >= (int)cache_index_size || cache_index[first + i] == -1) {
+            return 0;
+        }
+    }
 
-    int current = file->start_cluster;
-    while (current != FAT_END) {
-        // Check for corrupted clusters (out of valid range)
-        if (current < 0 || current >= max_clusters) {
-            printf(" -> [CORRUPTED: %d]", current);
-            break;
+    for (int i = 0; i < clusters; i++) {
+        size_t part = request->size - (size_t)i * CLUSTER_SIZE;
+        if (part > CLUSTER_SIZE) {
+            part = CLUSTER_SIZE;
         }
+        int slot = cache_lookup(first + i);
+        memcpy(request->buffer + (size_t)i * CLUSTER_SIZE, cache_data + (size_t)slot * CLUSTER_SIZE, part);
+        cache_hits++;
+    }
+    return 1;
+}
 
-        printf("%d", current);
+// After a chain read went to disk: prefer dirty cached copies and remember the clusters read
+void cache_absorb_read(IoRequest *request) {
+    int first = offset_cluster(request->offset);
+    int clusters = (int)(request->size / CLUSTER_SIZE);  // only whole clusters are worth caching
 
-        // Move to the next cluster
-        current = fat[current];
+    for (int i = 0; i < (int)((request->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE); i++) {
+        char *data = request->buffer + (size_t)i * CLUSTER_SIZE;
+        size_t part = request->size - (size_t)i * CLUSTER_SIZE;
+        if (part > CLUSTER_SIZE) {
+            part = CLUSTER_SIZE;
+        }
 
-        if (current != FAT_END) {
-            printf(" -> ");
+        int slot = cache_lookup(first + i);
+        if (slot != -1) {
+            if (cache_slots[slot].dirty) {
+                memcpy(data, cache_data + (size_t)slot * CLUSTER_SIZE, part);
+            }
+            cache_hits++;
+            continue;
+        }
+
+        cache_misses++;
+        if (i < clusters && (slot = cache_insert(first + i)) != -1) {
+            memcpy(cache_data + (size_t)slot * CLUSTER_SIZE, data, CLUSTER_SIZE);
         }
     }
-    printf("\n");
 }
 
-void incp(const char *args) {
-    if (!args || strlen(args) == 0) {
-        printf("INVALID ARGUMENTS\n");
-        return;
-    }
+// After a chain write went to disk: refresh cached copies. A full-cluster write also makes
+// the slot clean; a partial one keeps it dirty because its tail may not be on disk yet.
+void cache_absorb_write(IoRequest *request) {
+    int first = offset_cluster(request->offset);
 
-    char source[MAX_PATH_LENGTH], destination[MAX_PATH_LENGTH];
+    for (int i = 0; i < (int)((request->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE); i++) {
+        int slot = cache_lookup(first + i);
+        if (slot == -1) {
+            continue;
+        }
 
-    // Parse input arguments
-    int parsed = sscanf(args, "%s %s", source, destination);
-    if (parsed != 2) {
-        printf("INVALID ARGUMENTS\n");
-        return;
+        size_t part = request->size - (size_t)i * CLUSTER_SIZE;
+        if (part >= CLUSTER_SIZE) {
+            part = CLUSTER_SIZE;
+            cache_slots[slot].dirty = 0;
+        }
+        memcpy(cache_data + (size_t)slot * CLUSTER_SIZE, request->buffer + (size_t)i * CLUSTER_SIZE, part);
     }
+}
 
-    FILE *src = fopen(source, "rb");
-    if (!src) {
-        printf("FILE NOT FOUND\n");
+void read_cluster_data(int cluster_index, char *buffer, size_t size) {
+    if (disk_fd < 0) {
+        printf("ERROR: Cannot open filesystem file\n");
+        return;
+    }
+    if (!cache_capacity || size > CLUSTER_SIZE) {
+        if (cache_capacity) {
+            cache_flush();
+        }
+        disk_read(cluster_offset(cluster_index), buffer, size);
         return;
     }
 
-    char full_path[MAX_PATH_LENGTH];
-    normalize_path(full_path, destination);
+    int slot = cache_lookup(cluster_index);
+    if (slot != -1) {
+        cache_hits++;
+    } else {
+        cache_misses++;
+        slot = cache_insert(cluster_index);
+        if (slot == -1) {
+            disk_read(cluster_offset(cluster_index), buffer, size);
+            return;
+        }
+        disk_read(cluster_offset(cluster_index), cache_data + (size_t)slot * CLUSTER_SIZE, CLUSTER_SIZE);
+    }
+    memcpy(buffer, cache_data + (size_t)slot * CLUSTER_SIZE, size);
+}
 
-    // Check if the file already exists in the filesystem
-    if (find_file(full_path) != -1) {
-        printf("EXIST\n");
-        fclose(src);
+void write_cluster_data(int cluster_index, const char *data, size_t size) {
+    if (disk_fd < 0) {
+        printf("ERROR: Cannot open filesystem file\n");
         return;
     }
-
-    if (file_count >= MAX_FILES) {
-        printf("Filesystem is full.\n");
-        fclose(src);
+    if (!cache_capacity || size > CLUSTER_SIZE) {
+        IoRequest request = {1, cluster_offset(cluster_index), (char *)data, size};
+        disk_write(request.offset, data, size);  // Determine the cluster offset in the file
+        if (cache_capacity) {
+            cache_absorb_write(&request);
+        }
         return;
     }
 
-    // Determine the file size
-    fseek(src, 0, SEEK_END);
-    size_t file_size = ftell(src);
-    rewind(src);
-
-    size_t needed_clusters = (file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
-    int free_clusters = count_free_clusters();
+    // Write-back: the cluster only reaches the image on eviction, sync, drop_caches or exit
+    int slot = cache_lookup(cluster_index);
+    if (slot == -1) {
+        slot = cache_insert(cluster_index);
+        if (slot == -1) {
+            disk_write(cluster_offset(cluster_index), data, size);
+            return;
+        }
+        if (size < CLUSTER_SIZE) {
+            disk_read(cluster_offset(cluster_index), cache_data + (size_t)slot * CLUSTER_SIZE, CLUSTER_SIZE);
+        }
+    }
+    memcpy(cache_data + (size_t)slot * CLUSTER_SIZE, data, size);
+    cache_slots[slot].dirty = 1;
+}
 
-    printf("need:%zu / free:%zu\n", needed_clusters, free_clusters);
+// Take the next run of physically consecutive clusters (at most max_count) from the chain at *cluster.
+// *cluster is advanced to the cluster following the run. Returns 0 once the chain ends or is broken.
+int next_extent(int *cluster, size_t max_count, Extent *extent) {
+    int current = *cluster;
+    if (current < 0 || current >= (int)max_clusters || max_count == 0) {
+        return 0;
+    }
 
-    // Check if there are enough free clusters
-    if (needed_clusters > free_clusters) {
-        printf("NO FREE CLUSTERS\n");
-        fclose(src);
-        return;
+    extent->start = current;
+    extent->count = 1;
+    while (extent->count < max_count && fat[current] == current + 1) {
+        current++;
+        extent->count++;
     }
 
-    // Create a new file entry in the pseudo-FAT
-    FileEntry new_file;
-    strncpy(new_file.filename, full_path, MAX_PATH_LENGTH);
-    new_file.size = file_size;
-    new_file.start_cluster = allocate_cluster(&new_file);
-    new_file.is_directory = 0;
+    *cluster = fat[current];
+    return 1;
+}
 
-    filesystem[file_count++] = new_file;
+// Queue one request per extent of the next size bytes of the chain at *cluster. Async engines get
+// the extents cut into IO_CHUNK_CLUSTERS pieces so that a single long run still fills the queue.
+// requests holds MAX_EXTENT_CLUSTERS, which one window never exceeds; past that it stops with
+// *cluster at the first cluster not queued.
+int build_chain_requests(int *cluster, char *buffer, size_t size, int is_write, IoRequest *requests) {
+    size_t chunk = io_engine == IO_ENGINE_SYNC || disk_map ? MAX_EXTENT_CLUSTERS : IO_CHUNK_CLUSTERS;
+    int count = 0;
+    Extent extent;
+
+    while (size > 0 && count < MAX_EXTENT_CLUSTERS &&
+           next_extent(cluster, (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE, &extent)) {
+        for (size_t done = 0; done < extent.count && size > 0; done += chunk) {
+            if (count == MAX_EXTENT_CLUSTERS) {
+                *cluster = extent.start + (int)done;
+                return count;
+            }
+            size_t clusters = extent.count - done < chunk ? extent.count - done : chunk;
+            size_t bytes = clusters * CLUSTER_SIZE < size ? clusters * CLUSTER_SIZE : size;
 
-    // Write data to FAT-based system (simulated disk)
-    size_t cluster_index = new_file.start_cluster;
-    size_t bytes_left = file_size;
-    char buffer[CLUSTER_SIZE];
+            requests[count].is_write = is_write;
+            requests[count].offset = cluster_offset(extent.start + (int)done);
+            requests[count].buffer = buffer;
+            requests[count].size = bytes;
+            count++;
 
-    while (bytes_left > 0 && cluster_index != FAT_END) {
-        size_t to_read = (bytes_left > CLUSTER_SIZE) ? CLUSTER_SIZE : bytes_left;
-        fread(buffer, 1, to_read, src);
+            buffer += bytes;
+            size -= bytes;
+        }
+    }
+    return count;
+}
 
-        // Write buffer to simulated disk
-        write_cluster_data(cluster_index, buffer, to_read);
+// Read size bytes (at most one window of MAX_EXTENT_CLUSTERS) from the chain at *cluster,
+// one request per extent, and advance *cluster past them.
+void read_chain_data(int *cluster, char *buffer, size_t size) {
+    IoRequest requests[MAX_EXTENT_CLUSTERS];
+    if (disk_fd < 0) {
+        printf("ERROR: Cannot open filesystem file\n");
+        return;
+    }
+    int start = *cluster;
+    int count = build_chain_requests(cluster, buffer, size, 0, requests);
 
-        bytes_left -= to_read;
-        cluster_index = fat[cluster_index];  // Move to the next cluster
+    // Let the kernel fetch the following clusters while the caller consumes this window
+    read_ahead(start, *cluster, (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+    if (!cache_capacity) {
+        submit_io_batch(requests, count);
+        return;
     }
 
-    fclose(src);
-    printf("OK\n");
+    // Only the requests the cache cannot fully serve go to the engine
+    int pending = 0;
+    for (int i = 0; i < count; i++) {
+        if (!cache_serve_read(&requests[i])) {
+            requests[pending++] = requests[i];
+        }
+    }
+    submit_io_batch(requests, pending);
+    for (int i = 0; i < pending; i++) {
+        cache_absorb_read(&requests[i]);
+    }
 }
 
-void outcp(const char *args) {
-    if (!args || strlen(args) == 0) {
-        printf("INVALID ARGUMENTS\n");
+void write_chain_data(int *cluster, const char *buffer, size_t size) {
+    IoRequest requests[MAX_EXTENT_CLUSTERS];
+    if (disk_fd < 0) {
+        printf("ERROR: Cannot open filesystem file\n");
         return;
     }
+    int count = build_chain_requests(cluster, (char *)buffer, size, 1, requests);
+    submit_io_batch(requests, count);
+    for (int i = 0; i < count && cache_capacity; i++) {
+        cache_absorb_write(&requests[i]);
+    }
+}
 
-    char source[MAX_PATH_LENGTH], destination[MAX_PATH_LENGTH];
-
-    // Parse input arguments
-    int parsed = sscanf(args, "%s %s", source, destination);
-    if (parsed != 2) {
-        printf("INVALID ARGUMENTS\n");
+// Hint the kernel about upcoming clusters of the chain. A read that starts where the previous one
+// ended counts as sequential and doubles the window; anything else restarts it at the minimum.
+void read_ahead(int start, int next, size_t clusters) {
+    ReadAhead *ra = &readahead_state;
+    if (ra->max_window == 0) {
         return;
     }
 
-    char full_path[MAX_PATH_LENGTH];
-    normalize_path(full_path, source);
-
-    // Locate the file in the pseudo-FAT
-    int file_index = find_file(full_path);
-    if (file_index == -1) {
-        printf("FILE NOT FOUND\n");
-        return;
+    if (start == ra->expected && start >= 0) {
+        ra->ahead_count = ra->ahead_count > clusters ? ra->ahead_count - clusters : 0;
+        ra->window = ra->window * 2 < ra->max_window ? ra->window * 2 : ra->max_window;
+    } else {
+        ra->ahead_count = 0;
+        ra->window = READAHEAD_MIN_CLUSTERS < ra->max_window ? READAHEAD_MIN_CLUSTERS : ra->max_window;
+    }
+    ra->expected = next;
+    if (ra->ahead_count == 0) {
+        ra->ahead = next;
     }
 
-    FileEntry *file = &filesystem[file_index];
+    // Walk the FAT ahead of the reader and advise one contiguous run at a time
+    Extent extent;
+    while (ra->ahead_count < ra->window && next_extent(&ra->ahead, ra->window - ra->ahead_count, &extent)) {
+        off_t offset = cluster_offset(extent.start);
+        size_t length = extent.count * CLUSTER_SIZE;
+        if (disk_map && offset + length <= disk_map_size) {
+            size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            size_t aligned = (size_t)offset & ~(page - 1);
+            madvise(disk_map + aligned, (size_t)offset + length - aligned, MADV_WILLNEED);
+        } else {
+            posix_fadvise(disk_fd, offset, (off_t)length, POSIX_FADV_WILLNEED);
+        }
+        ra->ahead_count += extent.count;
+    }
+}
 
-    FILE *dest = fopen(destination, "wb");
-    if (!dest) {
-        printf("PATH NOT FOUND\n");
+// Copy size bytes between two chains of the image without leaving the kernel. The chains are
+// walked in lockstep and every overlapping pair of source/destination extents becomes one
+// copy_file_range call; if the kernel or the host filesystem refuses, the rest of the copy
+// goes through a user-space buffer instead.
+void copy_chain_data(int src_cluster, int dest_cluster, size_t size) {
+    if (disk_fd < 0) {
+        printf("ERROR: Cannot open filesystem file\n");
         return;
     }
 
-    size_t cluster_index = file->start_cluster;
-    size_t bytes_left = file->size;
-    char buffer[CLUSTER_SIZE];
+    // The kernel copies what is on disk, so dirty cached clusters have to get there first,
+    // and whatever the cache holds for the destination is about to be stale
+    cache_flush();
+    int cluster = dest_cluster;
+    Extent extent;
+    for (size_t left = size; left > 0 && next_extent(&cluster, MAX_EXTENT_CLUSTERS, &extent);) {
+        cache_forget(extent.start, extent.count);
+        left -= extent.count * CLUSTER_SIZE < left ? extent.count * CLUSTER_SIZE : left;
+    }
+    copy_chain_extents(src_cluster, dest_cluster, size);
+}
 
-    // Read and write file content cluster by cluster
-    while (bytes_left > 0 && cluster_index != FAT_END) {
-        size_t to_read = (bytes_left > CLUSTER_SIZE) ? CLUSTER_SIZE : bytes_left;
+// The copy itself: it only reads the FAT and goes to the image directly, never through the
+// cache, so the parallel directory copy runs it on several threads at once
+void copy_chain_extents(int src_cluster, int dest_cluster, size_t size) {
+    Extent src_extent, dest_extent;
+    off_t src_offset = 0, dest_offset = 0;
+    size_t src_left = 0, dest_left = 0;
+    int use_kernel = 1;
+    char *buffer = NULL;
+
+    while (size > 0) {
+        if (src_left == 0) {
+            if (!next_extent(&src_cluster, MAX_EXTENT_CLUSTERS, &src_extent)) {
+                break;
+            }
+            src_offset = cluster_offset(src_extent.start);
+            src_left = src_extent.count * CLUSTER_SIZE;
+        }
+        if (dest_left == 0) {
+            if (!next_extent(&dest_cluster, MAX_EXTENT_CLUSTERS, &dest_extent)) {
+                break;
+            }
+            dest_offset = cluster_offset(dest_extent.start);
+            dest_left = dest_extent.count * CLUSTER_SIZE;
+        }
 
-        read_cluster_data(cluster_index, buffer, to_read);
-        fwrite(buffer, 1, to_read, dest);
+        size_t length = src_left < dest_left ? src_left : dest_left;
+        if (length > size) {
+            length = size;
+        }
 
-        bytes_left -= to_read;
-        cluster_index = fat[cluster_index];  // Move to the next cluster
+        ssize_t copied = -1;
+        if (use_kernel) {
+            copied = copy_file_range(disk_fd, &src_offset, disk_fd, &dest_offset, length, 0);
+            if (copied < 0 && errno == EINTR) {
+                continue;
+            }
+            if (copied <= 0) {
+                use_kernel = 0;  // ENOSYS, EXDEV, EINVAL...: fall back for the rest of the copy
+            }
+        }
+
+        if (!use_kernel) {
+            if (!buffer && !(buffer = malloc(MAX_EXTENT_CLUSTERS * CLUSTER_SIZE))) {
+                printf("ERROR: Cannot allocate copy buffer\n");
+                return;
+            }
+            copied = (ssize_t)(length < MAX_EXTENT_CLUSTERS * CLUSTER_SIZE ? length : MAX_EXTENT_CLUSTERS * CLUSTER_SIZE);
+            disk_read(src_offset, buffer, (size_t)copied);
+            disk_write(dest_offset, buffer, (size_t)copied);
+            src_offset += copied;
+            dest_offset += copied;
+        }
+
+        src_left -= (size_t)copied;
+        dest_left -= (size_t)copied;
+        size -= (size_t)copied;
     }
 
-    fclose(dest);
-    printf("OK\n");
+    free(buffer);
 }
 
-int execute_command(const char *command) {
-    for (int i = 0; i < sizeof(command_table) / sizeof(command_table[0]); i++) {
-        if (strncmp(command_table[i].command_name, command, strlen(command_table[i].command_name)) == 0) {
-            command_table[i].command_func(command);
-            return 0;
+// Write all of data to a host descriptor
+int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        size -= (size_t)n;
     }
-    printf("UNKNOWN COMMAND: %s\n", command);
-    return -1;
+    return 0;
 }
 
-int execute_command_with_args(const char *command) {
-    // Find the first space that separates the command name from its arguments
-    const char *space = strchr(command, ' ');
-    char cmd_name[128] = {0};
-    const char *args = NULL;
-
-    if (space) {
-        // Copy the command name
-        strncpy(cmd_name, command, space - command);
-        cmd_name[space - command] = '\0';
-        args = space + 1; // Arguments start immediately after the space
-    } else {
-        // If there is no space, the entire string is the command name
-        strncpy(cmd_name, command, sizeof(cmd_name) - 1);
-    }
+// Stream size bytes of the chain to a host descriptor (outcp, cat) without a user-space copy:
+// each extent is handed to sendfile, and the last one is cut at size so the tail of the final
+// cluster is not sent. A mapped image is written straight from the mapping. If sendfile is
+// refused for the target, the rest goes through a bounce buffer.
+void send_chain_data(int cluster, size_t size, int out_fd) {
+    Extent extent;
+    int use_kernel = 1;
+    char *buffer = NULL;
 
-    // Search for the command in the table
-    for (int i = 0; i < sizeof(command_table) / sizeof(command_table[0]); i++) {
-        if (strcmp(command_table[i].command_name, cmd_name) == 0) {
-            // Call the function with arguments (or NULL if there are no arguments)
-            command_table[i].command_func(args);
-            return 0;
-        }
+    if (disk_fd < 0) {
+        printf("ERROR: Cannot open filesystem file\n");
+        return;
     }
 
-    // If the command is not found
-    printf("UNKNOWN COMMAND: %s\n", cmd_name);
-    return -1;
-}
+    // sendfile reads the image file, so dirty cached clusters have to be written first
+    cache_flush();
 
-void load(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        printf("FILE NOT FOUND\n");
-        return;
+    // Into a pipe, sendfile passes references to the image's page cache rather than a copy, so
+    // a reader would see whatever is written to those clusters later; pipes get a copy instead
+    struct stat out_st;
+    if (fstat(out_fd, &out_st) == 0 && S_ISFIFO(out_st.st_mode)) {
+        use_kernel = 0;
     }
 
-    char line[256];
-    while (fgets(line, sizeof(line), file)) {
-        line[strcspn(line, "\n")] = '\0'; // Remove the newline character
+    while (size > 0) {
+        int start = cluster;
+        if (!next_extent(&cluster, MAX_EXTENT_CLUSTERS, &extent)) {
+            break;
+        }
+        read_ahead(start, cluster, extent.count);
 
-        // Split command and arguments
-        char cmd_name[128] = {0};
-        char args[128] = {0};
+        off_t offset = cluster_offset(extent.start);
+        size_t length = extent.count * CLUSTER_SIZE < size ? extent.count * CLUSTER_SIZE : size;
+        size -= length;
 
-        // Use sscanf to split the line into command name and arguments
-        int parts = sscanf(line, "%127s %127[^\n]", cmd_name, args);
+        if (disk_map && offset + length <= disk_map_size) {
+            if (write_all(out_fd, disk_map + offset, length) != 0) {
+                printf("ERROR: Cannot write output (errno: %d)\n", errno);
+                break;
+            }
+            continue;
+        }
 
-        if (parts >= 1) { // If there is at least a command
-            printf("Executing: %s %s\n", cmd_name, parts == 2 ? args : "");
-            if (parts == 2) {
-                char command[100];
-                snprintf(command, sizeof(command), "%s %s", cmd_name, args);
-                execute_command_with_args(command);
+        while (length > 0 && use_kernel) {
+            ssize_t sent = sendfile(out_fd, disk_fd, &offset, length);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                use_kernel = 0;  // EINVAL, ENOSYS...: the target cannot take sendfile
+                break;
+            }
+            length -= (size_t)sent;
+        }
 
-            } else {
-                execute_command(cmd_name);
+        while (length > 0) {
+            if (!buffer && !(buffer = malloc(MAX_EXTENT_CLUSTERS * CLUSTER_SIZE))) {
+                printf("ERROR: Cannot allocate read buffer\n");
+                return;
             }
-        } else {
-            printf("UNKNOWN COMMAND FORMAT: %s\n", line);
+            disk_read(offset, buffer, length);
+            if (write_all(out_fd, buffer, length) != 0) {
+                printf("ERROR: Cannot write output (errno: %d)\n", errno);
+                free(buffer);
+                return;
+            }
+            length = 0;
         }
     }
 
-    fclose(file);
-    printf("OK\n");
+    free(buffer);
 }
 
-void format(const char *arg) {
-    if (!arg || !*arg) {
-        printf("CANNOT CREATE FILE\n");
-        return;
+void run_io_request(IoRequest *request) {
+    if (request->is_write) {
+        disk_write(request->offset, request->buffer, request->size);
+    } else {
+        disk_read(request->offset, request->buffer, request->size);
     }
+}
 
-    long size = 0;
-    char suffix[8] = {0};
-
-    // Parse string like "600MB", "600KB", or "600"
-    if (sscanf(arg, "%ld%2s", &size, suffix) < 1) {
-        printf("CANNOT CREATE FILE\n");
+#ifdef __linux__
+// Minimal io_uring driven through the raw syscalls, so no liburing is needed
+struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+} uring = {.fd = -1};
+
+void uring_teardown() {
+    if (uring.fd < 0) {
         return;
     }
+    munmap(uring.sqes, uring.sqes_size);
+    if (uring.cq_ring != uring.sq_ring) {
+        munmap(uring.cq_ring, uring.cq_ring_size);
+    }
+    munmap(uring.sq_ring, uring.sq_ring_size);
+    close(uring.fd);
+    uring.fd = -1;
+}
 
-    // 🔥 Determine size in bytes (default - megabytes)
-    size_t required_size = 0;
+int uring_setup(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
 
-    if (suffix[0] == '\0' || strcasecmp(suffix, "MB") == 0) {
-        required_size = (size_t)size * 1024 * 1024;  // Default to MB
-    } else if (strcasecmp(suffix, "KB") == 0) {
-        required_size = (size_t)size * 1024;  // Convert to KB
-    } else {
-        printf("CANNOT CREATE FILE\n");
-        return;
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return -1;
     }
 
-    if (size <= 0) {
-        printf("CANNOT CREATE FILE\n");
-        return;
+    uring.fd = fd;
+    uring.entries = params.sq_entries;
+    uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring.cq_ring_size > uring.sq_ring_size) {
+            uring.sq_ring_size = uring.cq_ring_size;
+        }
+        uring.cq_ring_size = uring.sq_ring_size;
     }
 
-    // Use the file specified at program start (disk_filename)
-    FILE *fs_file = fopen(disk_filename, "wb");
-    if (!fs_file) {
-        printf("CANNOT CREATE FILE\n");
-        return;
+    uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_SQ_RING);
+    if (uring.sq_ring == MAP_FAILED) {
+        close(fd);
+        uring.fd = -1;
+        return -1;
     }
 
-    // Set the new file size
-    if (ftruncate(fileno(fs_file), required_size) != 0) {
-        fclose(fs_file);
-        printf("CANNOT CREATE FILE\n");
-        return;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring.cq_ring = uring.sq_ring;
+    } else {
+        uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             fd, IORING_OFF_CQ_RING);
+        if (uring.cq_ring == MAP_FAILED) {
+            munmap(uring.sq_ring, uring.sq_ring_size);
+            close(fd);
+            uring.fd = -1;
+            return -1;
+        }
     }
 
-    fclose(fs_file);
+    uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        if (uring.cq_ring != uring.sq_ring) {
+            munmap(uring.cq_ring, uring.cq_ring_size);
+        }
+        munmap(uring.sq_ring, uring.sq_ring_size);
+        close(fd);
+        uring.fd = -1;
+        return -1;
+    }
 
-    max_clusters = required_size / CLUSTER_SIZE;
+    char *sq = uring.sq_ring, *cq = uring.cq_ring;
+    uring.sq_head = (unsigned *)(sq + params.sq_off.head);
+    uring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
 
-    printf("_max_clusters: %llu_ / _required_size:%llu_\n", max_clusters, required_size);
-    // Reset and initialize the file system
-    initialize_filesystem();
+// Handle every completion posted so far; a completed request gets a NULL iov_base.
+// Returns how many were handled.
+unsigned uring_reap(IoRequest *requests) {
+    unsigned reaped = 0;
+    unsigned head = *uring.cq_head;
+    while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+        IoRequest *request = &requests[cqe->user_data];
+
+        if (cqe->res < 0 || (size_t)cqe->res < request->size) {
+            // Short transfer or error: redo the remainder with the blocking path
+            size_t done = cqe->res > 0 ? (size_t)cqe->res : 0;
+            IoRequest rest = *request;
+            rest.offset += done;
+            rest.buffer += done;
+            rest.size -= done;
+            run_io_request(&rest);
+        }
+        request->iov.iov_base = NULL;
 
-    printf("OK\n");
+        head++;
+        reaped++;
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
 }
 
-void normalize_path(char *normalized_path, const char *input_path) {
-    if (input_path[0] == '/') {
-        // Already an absolute path
-        strncpy(normalized_path, input_path, MAX_PATH_LENGTH);
-    } else {
-        // Append the current path
-        if (strcmp(current_path, "/") == 0) {
-            snprintf(normalized_path, MAX_PATH_LENGTH, "/%s", input_path);
-        } else {
-            snprintf(normalized_path, MAX_PATH_LENGTH, "%s/%s", current_path, input_path);
+// io_uring_enter failed: nothing of this batch may outlive the call, and nothing stale may
+// reach the next one. Entries the kernel never consumed are taken back, the ones in flight are
+// waited for, the ring is torn down and the rest of the batch runs synchronously.
+void uring_abandon_batch(IoRequest *requests, int count, int queued, unsigned in_flight) {
+    unsigned head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+    queued -= (int)(*uring.sq_tail - head);
+    __atomic_store_n(uring.sq_tail, head, __ATOMIC_RELEASE);
+
+    while (in_flight > 0) {
+        unsigned reaped = uring_reap(requests);
+        in_flight -= reaped;
+        if (in_flight > 0 && reaped == 0 &&
+            syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            break;  // Cannot even wait; closing the ring cancels what is left
         }
     }
+    uring_teardown();
 
-    // Remove double slashes if they appear
-    char *src = normalized_path, *dst = normalized_path;
-    while (*src) {
-        *dst = *src++;
-        if (*dst != '/' || (dst == normalized_path || *(dst - 1) != '/')) {
-            dst++;
+    // Whatever did not report completion is redone; transfers are idempotent
+    for (int i = 0; i < count; i++) {
+        if (i >= queued || requests[i].iov.iov_base != NULL) {
+            run_io_request(&requests[i]);
         }
     }
-    *dst = '\0';
 }
 
-void bug(const char *arg) {
-    if (arg == NULL || strcmp(arg, "") == 0) {
-        printf("Usage: bug <filename>\n");
-        return;
+// Keep up to io_queue_depth requests in flight until the whole batch has completed
+void uring_submit_batch(IoRequest *requests, int count) {
+    int next = 0, completed = 0;
+    unsigned in_flight = 0, unsubmitted = 0;
+    unsigned depth = (unsigned)io_queue_depth < uring.entries ? (unsigned)io_queue_depth : uring.entries;
+
+    while (completed < count) {
+        unsigned tail = *uring.sq_tail;
+        unsigned to_submit = unsubmitted;
+        while (next < count && in_flight + to_submit < depth) {
+            IoRequest *request = &requests[next];
+            unsigned index = tail & *uring.sq_mask;
+            struct io_uring_sqe *sqe = &uring.sqes[index];
+
+            request->iov.iov_base = request->buffer;
+            request->iov.iov_len = request->size;
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = request->is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = disk_fd;
+            sqe->addr = (unsigned long)&request->iov;
+            sqe->len = 1;
+            sqe->off = (unsigned long long)request->offset;
+            sqe->user_data = (unsigned long long)next;
+            uring.sq_array[index] = index;
+
+            tail++;
+            to_submit++;
+            next++;
+        }
+        __atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
+
+        int ret = (int)syscall(__NR_io_uring_enter, uring.fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            printf("ERROR: io_uring_enter failed (errno: %d), switching to the thread pool\n", errno);
+            uring_abandon_batch(requests, count, next, in_flight);
+            io_engine = io_pool_start(io_queue_depth) == 0 ? IO_ENGINE_THREADS : IO_ENGINE_SYNC;
+            return;
+        }
+        // Entries the kernel did not consume (EINTR, ring pressure) are retried on the next enter
+        unsigned consumed = ret > 0 ? (unsigned)ret : 0;
+        in_flight += consumed;
+        unsubmitted = to_submit - consumed;
+
+        unsigned reaped = uring_reap(requests);
+        in_flight -= reaped;
+        completed += (int)reaped;
     }
+}
+#endif
+
+// Thread-pool fallback: workers pull requests of the current batch until it is drained
+struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t threads[MAX_QUEUE_DEPTH];
+    int size;
+    int stop;
+    IoRequest *batch;
+    int count;
+    int next;
+    int remaining;
+} io_pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+
+void *io_pool_worker(void *unused) {
+    (void)unused;
+    pthread_mutex_lock(&io_pool.lock);
+    while (1) {
+        while (!io_pool.stop && (!io_pool.batch || io_pool.next >= io_pool.count)) {
+            pthread_cond_wait(&io_pool.work, &io_pool.lock);
+        }
+        if (io_pool.stop) {
+            break;
+        }
 
-    char full_path[MAX_PATH_LENGTH];
-    normalize_path(full_path, arg);
+        IoRequest *request = &io_pool.batch[io_pool.next++];
+        pthread_mutex_unlock(&io_pool.lock);
+        run_io_request(request);
+        pthread_mutex_lock(&io_pool.lock);
 
-    int index = find_file(full_path);
-    if (index == -1) {
-        printf("FILE %s NOT FOUND\n", full_path);
-        return;
+        if (--io_pool.remaining == 0) {
+            pthread_cond_signal(&io_pool.done);
+        }
     }
+    pthread_mutex_unlock(&io_pool.lock);
+    return NULL;
+}
 
-    FileEntry *entry = &filesystem[index];
+void io_pool_stop() {
+    pthread_mutex_lock(&io_pool.lock);
+    io_pool.stop = 1;
+    pthread_cond_broadcast(&io_pool.work);
+    pthread_mutex_unlock(&io_pool.lock);
 
-    if (entry->is_directory) {
-        printf("CANNOT CORRUPT DIRECTORY: %s\n", full_path);
+    for (int i = 0; i < io_pool.size; i++) {
+        pthread_join(io_pool.threads[i], NULL);
+    }
+    io_pool.size = 0;
+    io_pool.stop = 0;
+}
+
+int io_pool_start(int threads) {
+    io_pool_stop();
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&io_pool.threads[i], NULL, io_pool_worker, NULL) != 0) {
+            break;
+        }
+        io_pool.size++;
+    }
+    return io_pool.size > 0 ? 0 : -1;
+}
+
+void io_pool_submit_batch(IoRequest *requests, int count) {
+    pthread_mutex_lock(&io_pool.lock);
+    io_pool.batch = requests;
+    io_pool.count = count;
+    io_pool.next = 0;
+    io_pool.remaining = count;
+    pthread_cond_broadcast(&io_pool.work);
+    while (io_pool.remaining > 0) {
+        pthread_cond_wait(&io_pool.done, &io_pool.lock);
+    }
+    io_pool.batch = NULL;
+    pthread_mutex_unlock(&io_pool.lock);
+}
+
+// Run a batch of transfers on the selected engine and return once all of them are done
+void submit_io_batch(IoRequest *requests, int count) {
+    if (count == 0) {
         return;
     }
 
-    if (entry->start_cluster == FAT_FREE) {
-        printf("FILE %s has no allocated clusters.\n", full_path);
+    // A mapped image is served by memcpy; queueing it would only add overhead
+    if (count == 1 || disk_map || io_engine == IO_ENGINE_SYNC) {
+        for (int i = 0; i < count; i++) {
+            run_io_request(&requests[i]);
+        }
         return;
     }
 
-    // Collect all clusters of the file
-    int cluster_list[MAX_CLUSTERS];
-    int cluster_count = 0;
-    int current = entry->start_cluster;
+#ifdef __linux__
+    if (io_engine == IO_ENGINE_URING) {
+        uring_submit_batch(requests, count);
+        return;
+    }
+#endif
+    io_pool_submit_batch(requests, count);
+}
 
-    while (current != FAT_END) {
-        if (cluster_count >= MAX_CLUSTERS) {
-            printf("ERROR: Too many clusters for file %s\n", full_path);
+void shutdown_io_engine() {
+#ifdef __linux__
+    uring_teardown();
+#endif
+    io_pool_stop();
+}
+
+// io [sync|uring|threads] [depth] - select the chain I/O engine and its queue depth
+void io_mode(const char *arg) {
+    static const char *engine_names[] = {"sync", "uring", "threads"};
+    char name[16] = {0};
+    int depth = io_queue_depth;
+
+    if (arg && *arg) {
+        int parsed = sscanf(arg, "%15s %d", name, &depth);
+        if (parsed < 1 || depth < 1 || depth > MAX_QUEUE_DEPTH) {
+            printf("Usage: io [sync|uring|threads] [depth 1-%d]\n", MAX_QUEUE_DEPTH);
             return;
         }
-        cluster_list[cluster_count++] = current;
-        current = fat[current];
-    }
 
-    // Select a random cluster
-    srand(time(NULL));
-    int random_cluster = cluster_list[rand() % cluster_count];
+        int engine;
+        if (strcmp(name, "sync") == 0) {
+            engine = IO_ENGINE_SYNC;
+        } else if (strcmp(name, "uring") == 0) {
+            engine = IO_ENGINE_URING;
+        } else if (strcmp(name, "threads") == 0) {
+            engine = IO_ENGINE_THREADS;
+        } else {
+            printf("Usage: io [sync|uring|threads] [depth 1-%d]\n", MAX_QUEUE_DEPTH);
+            return;
+        }
 
-    // Mark it as corrupted
-    fat[random_cluster] = -5;  // Marked as corrupted
-    printf("Corrupted cluster %d of file %s\n", random_cluster, full_path);
-}
+        shutdown_io_engine();
+        io_queue_depth = depth;
+        io_engine = engine;
 
-void check() {
-    int corrupted_found = 0;
-    for (int i = 0; i < max_clusters; i++) {
-        // Valid cluster values: FAT_FREE, FAT_END, or a valid cluster index
-        if (fat[i] != FAT_FREE && fat[i] != FAT_END && (fat[i] < 0 || fat[i] >= max_clusters)) {
-            printf("Cluster %d is corrupted: value %d\n", i, fat[i]);
-            corrupted_found++;
+        if (io_engine == IO_ENGINE_URING) {
+#ifdef __linux__
+            if (uring_setup((unsigned)io_queue_depth) != 0) {
+                printf("io_uring unavailable (errno: %d), using thread pool\n", errno);
+                io_engine = IO_ENGINE_THREADS;
+            }
+#else
+            printf("io_uring unavailable, using thread pool\n");
+            io_engine = IO_ENGINE_THREADS;
+#endif
+        }
+        if (io_engine == IO_ENGINE_THREADS && io_pool_start(io_queue_depth) != 0) {
+            printf("Cannot start I/O threads, using sync I/O\n");
+            io_engine = IO_ENGINE_SYNC;
         }
     }
-    if (corrupted_found == 0)
-        printf("Filesystem is OK\n");
-    else
-        printf("Total corrupted clusters found: %d\n", corrupted_found);
+
+    printf("io engine: %s, queue depth: %d\n", engine_names[io_engine], io_queue_depth);
 }
 
-int count_free_clusters() {
-    int free_clusters = 0;
-    for (int i = 0; i < max_clusters; i++) {
-        if (fat[i] == FAT_FREE) {
-            free_clusters++;
+// cache [size_mb] - report cache statistics, optionally resizing it first (0 turns it off)
+// read, write, append, incp and cat of small files go through the cache; cp, outcp and cat of
+// larger files flush it and let the kernel move the data
+void cache_cmd(const char *arg) {
+    if (arg && *arg) {
+        long size_mb;
+        if (sscanf(arg, "%ld", &size_mb) != 1 || size_mb < 0) {
+            printf("Usage: cache [size_mb]\n");
+            return;
         }
+        cache_flush();
+        if (cache_configure((size_t)size_mb) != 0) {
+            printf("ERROR: Cannot allocate %ld MB of cache\n", size_mb);
+        }
+    }
+
+    size_t lookups = cache_hits + cache_misses;
+    int dirty = 0;
+    for (int i = 0; i < cache_used; i++) {
+        dirty += cache_slots[i].dirty;
     }
-    return free_clusters;
+
+    printf("Cache size: %zu MB (%d clusters)\n", cache_mb, cache_capacity);
+    printf("Cached clusters: %d (%d dirty)\n", cache_used, dirty);
+    printf("Hits: %zu, misses: %zu, hit rate: %.1f%%\n", cache_hits, cache_misses,
+           lookups ? 100.0 * (double)cache_hits / (double)lookups : 0.0);
+    printf("Write-backs: %zu\n", cache_writebacks);
 }
 
-void read_cluster_data(int cluster_index, char *buffer, size_t size) {
-    FILE *fs_file = fopen(disk_filename, "rb"); // Open the file in read-only mode
-    if (!fs_file) {
-        printf("ERROR: Cannot open filesystem file\n");
-        return;
+// readahead [max_clusters] - show or cap the adaptive read-ahead window (0 turns it off)
+void readahead_cmd(const char *arg) {
+    if (arg && *arg) {
+        long max_window;
+        if (sscanf(arg, "%ld", &max_window) != 1 || max_window < 0) {
+            printf("Usage: readahead [max_clusters]\n");
+            return;
+        }
+        readahead_state.max_window = (size_t)max_window;
+        readahead_state.expected = FAT_END;
+        readahead_state.ahead_count = 0;
     }
 
-    size_t offset = cluster_index * CLUSTER_SIZE;
-    fseek(fs_file, offset, SEEK_SET);  // Move the file pointer
-    fread(buffer, 1, size, fs_file);  // Read the data
+    printf("Read-ahead: max %zu clusters (%zu KB), current window %zu clusters\n", readahead_state.max_window,
+           readahead_state.max_window * CLUSTER_SIZE / 1024, readahead_state.window);
+}
 
-    fclose(fs_file);
+// drop_caches - write back and empty the cache so that benchmarks start cold
+void drop_caches(const char *arg) {
+    (void)arg;
+    cache_flush();
+    cache_configure(cache_mb);
+    cache_hits = cache_misses = cache_writebacks = 0;
+    printf("OK\n");
 }
 
-void write_cluster_data(int cluster_index, const char *data, size_t size) {
-    FILE *fs_file = fopen(disk_filename, "r+b"); // Open the file for reading and writing
-    if (!fs_file) {
-        printf("ERROR: Cannot open filesystem file\n");
-        return;
+// sync - push the metadata, dirty clusters and the mapping to the image file
+void sync_cmd(const char *arg) {
+    (void)arg;
+    write_metadata(0);
+    cache_flush();
+    sync_disk();
+    printf("OK\n");
+}
+
+// mmap [on|off] [sync|async|none] - switch the memory-mapped backend and its flush policy
+void mmap_mode(const char *arg) {
+    static const char *policy_names[] = {"sync", "async", "none"};
+    char words[2][16] = {{0}};
+    int count = arg ? sscanf(arg, "%15s %15s", words[0], words[1]) : 0;
+
+    for (int i = 0; i < count; i++) {
+        if (strcmp(words[i], "on") == 0) {
+            use_mmap = 1;
+        } else if (strcmp(words[i], "off") == 0) {
+            use_mmap = 0;
+        } else if (strcmp(words[i], "sync") == 0) {
+            msync_policy = MSYNC_SYNC;
+        } else if (strcmp(words[i], "async") == 0) {
+            msync_policy = MSYNC_ASYNC;
+        } else if (strcmp(words[i], "none") == 0) {
+            msync_policy = MSYNC_NONE;
+        } else {
+            printf("Usage: mmap [on|off] [sync|async|none]\n");
+            return;
+        }
     }
 
-    size_t offset = cluster_index * CLUSTER_SIZE;  // Determine the cluster offset in the file
-    fseek(fs_file, offset, SEEK_SET);
-    fwrite(data, 1, size, fs_file);
+    if (use_mmap && !disk_map) {
+        if (map_disk() != 0) {
+            use_mmap = 0;
+            printf("CANNOT MAP FILE\n");
+            return;
+        }
+    } else if (!use_mmap && disk_map) {
+        unmap_disk();
+    }
 
-    fclose(fs_file);
+    printf("mmap: %s, flush policy: %s\n", disk_map ? "on" : "off", policy_names[msync_policy]);
 }
 
 int main(int argc, char *argv[]) {
@@ -1138,13 +5063,26 @@ int main(int argc, char *argv[]) {
     strncpy(disk_filename, argv[1], MAX_PATH_LENGTH);
     disk_filename[MAX_PATH_LENGTH - 1] = '\0'; // защита от переполнения
 
-    initialize_filesystem();
-    format("10mb");
-    add_to_filesystem("f1", 0);
-    add_to_filesystem("a1", 1);
-    add_to_filesystem("a1/a2", 1);
-    add_to_filesystem("a1/f3", 0);
-    add_to_filesystem("abc", 1);
+    if (open_disk() != 0) {
+        return EXIT_FAILURE;
+    }
+    select_fat_kernels();
+
+    // An existing image is mounted as it is; only a new (or foreign) file gets formatted
+    int mounted = mount_filesystem();
+    if (mounted == MOUNT_CORRUPTED) {
+        close_disk();
+        return EXIT_FAILURE;
+    }
+    if (mounted == MOUNT_NO_FILESYSTEM) {
+        initialize_filesystem();
+        format("10mb");
+        add_to_filesystem("f1", 0);
+        add_to_filesystem("a1", 1);
+        add_to_filesystem("a1/a2", 1);
+        add_to_filesystem("a1/f3", 0);
+        add_to_filesystem("abc", 1);
+    }
 
 
 
@@ -1177,6 +5115,10 @@ int main(int argc, char *argv[]) {
         execute_command_with_args(line);
     }
 
+    write_metadata(1);
+    cache_flush();
+    shutdown_io_engine();
+    close_disk();
     free(fat);
 
     return EXIT_SUCCESS;